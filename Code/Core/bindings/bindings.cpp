@@ -122,6 +122,19 @@ extern "C" {
         world->add_delimiter_plane(&world->delimiters[delimiter_index], axis, centered, extension);
     }
 
+    void core_move_delimiter(World_Handle world_handle, s64 delimiter_index, f64 x, f64 y, f64 z, f64 rx, f64 ry, f64 rz, f64 rw) {
+        World *world = (World *) world_handle;
+        world->move_delimiter(&world->delimiters[delimiter_index], vec3((real) x, (real) y, (real) z), quat((real) rx, (real) ry, (real) rz, (real) rw));
+    }
+
+    void core_set_bvh_cache(World_Handle world_handle, const char *file_path) {
+        World *world = (World *) world_handle;
+        string path;
+        path.count = strlen(file_path);
+        path.data  = (u8 *) file_path;
+        world->set_bvh_cache(path);
+    }
+
     void core_calculate_volumes(World_Handle world_handle, f64 cell_world_space_size) {
         World *world = (World *) world_handle;
         world->calculate_volumes((real) cell_world_space_size);
@@ -10,6 +10,7 @@
 struct Assembler {
     World *world;
     Flood_Fill *ff;
+    Resizable_Array<vec3> cell_centers; // The world space centers of all flooded cells, so that they don't have to be derived from the cell indices for every triangle.
     Resizable_Array<Triangle> volume;
 
 #if USE_HASH_TABLE_IN_ASSEMBLER
@@ -22,22 +23,20 @@ struct Assembler {
 };
 
 static
-void assemble_triangle_against_cell(Assembler *assembler, vec3 cell_world_space_position, BVH_Entry *entry) {
+b8 triangle_already_in_volume(Assembler *assembler, BVH_Entry *entry) {
 #if USE_HASH_TABLE_IN_ASSEMBLER
-    // Make sure this triangle isn't already in the volume.
-    if(assembler->triangle_table.query(entry)) return;
+    if(assembler->triangle_table.query(entry)) return true;
 #endif
 
 #if USE_ART_IN_ASSEMBLER
-    if(assembler->triangle_art.query(entry)) return;
+    if(assembler->triangle_art.query(entry)) return true;
 #endif
 
-    // We add a little offset to the position here so that we don't find the triangle that we are
-    // actually casting from...
-    vec3 direction = cell_world_space_position - entry->center;
-    if(assembler->world->cast_ray_against_delimiters_and_root_planes(entry->center + direction * CORE_EPSILON, direction, 1.)) return;
+    return false;
+}
 
-    // Add the triangle to the volume
+static
+void add_triangle_to_volume(Assembler *assembler, BVH_Entry *entry) {
     assembler->volume.add(entry->triangle);
                 
 #if USE_HASH_TABLE_IN_ASSEMBLER
@@ -49,15 +48,48 @@ void assemble_triangle_against_cell(Assembler *assembler, vec3 cell_world_space_
 #endif
 }
 
+static
+b8 assemble_triangle_against_cells(Assembler *assembler, BVH_Ray_Packet *packet) {
+    // The triangle is part of the volume if any of the cells can see it.
+    u32 occluded_mask = assembler->world->cast_rays_against_delimiters_and_root_planes(packet);
+    u32 all_rays_mask = (u32) ((1ull << packet->count) - 1);
+    return occluded_mask != all_rays_mask;
+}
+
 static
 void assemble_triangle(Assembler *assembler, BVH_Entry *entry) {
-    for(Cell *cell : assembler->ff->flooded_cells) {
-        vec3 cell_world_space_position = get_cell_world_space_center(assembler->ff, cell);
-        assemble_triangle_against_cell(assembler, cell_world_space_position, entry);
+    // Make sure this triangle isn't already in the volume.
+    if(triangle_already_in_volume(assembler, entry)) return;
+
+    //
+    // All rays of one triangle start at the same point, so they are coherent enough to be cast as packets
+    // against the BVH.
+    //
+    BVH_Ray_Packet packet;
+    packet.count = 0;
+    
+    for(vec3 &cell_world_space_position : assembler->cell_centers) {
+        // We add a little offset to the position here so that we don't find the triangle that we are
+        // actually casting from...
+        vec3 direction = cell_world_space_position - entry->center;
+        packet.add(entry->center + direction * CORE_EPSILON, direction, 1.);
+
+        if(packet.count == BVH_PACKET_SIZE) {
+            if(assemble_triangle_against_cells(assembler, &packet)) {
+                add_triangle_to_volume(assembler, entry);
+                return;
+            }
+
+            packet.count = 0;
+        }
+    }
+
+    if(packet.count && assemble_triangle_against_cells(assembler, &packet)) {
+        add_triangle_to_volume(assembler, entry);
     }
 }
 
-Resizable_Array<Triangle> assemble(World *world, Flood_Fill *ff, Allocator *allocator) {
+Resizable_Array<Triangle> assemble(World *world, Flood_Fill *ff, Allocator *allocator, s64 slice, s64 slice_count) {
     tmFunction(TM_ASSEMBLING_COLOR);
 
     Assembler assembler;
@@ -70,6 +102,29 @@ Resizable_Array<Triangle> assemble(World *world, Flood_Fill *ff, Allocator *allo
     // once over to the world allocator when it is done (by using a lock).
     assembler.volume.allocator = allocator;
 
+    assembler.cell_centers.allocator = &temp;
+    assembler.cell_centers.reserve(ff->flooded_cells.count);
+
+    vec3 region_min = vec3(MAX_F32, MAX_F32, MAX_F32);
+    vec3 region_max = vec3(MIN_F32, MIN_F32, MIN_F32);
+
+    for(u32 index : ff->flooded_cells) {
+        vec3 center = get_cell_world_space_center(ff, get_cell_position(ff->grid, index));
+        assembler.cell_centers.add(center);
+
+        for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+            region_min.values[axis] = min(region_min.values[axis], center.values[axis]);
+            region_max.values[axis] = max(region_max.values[axis], center.values[axis]);
+        }
+    }
+
+    // :RootPlanesBVH
+    // A ray from a flooded cell which isn't blocked by any delimiter only passes through cells that would have
+    // been flooded as well, so the root triangles a region can see all lie within a few cells of its bounds.
+    vec3 margin = vec3(ff->grid->cell_world_space_size * ROOT_FACE_REGION_MARGIN);
+    region_min = region_min - margin;
+    region_max = region_max + margin;
+
     // When assembling the triangles that make up a volume, we want to make sure that we
     // don't have duplicates in that volume. This could happen because a triangle might have
     // line-of-sight to many flood-filling cells, in which case it would be added multiple
@@ -88,12 +143,44 @@ Resizable_Array<Triangle> assemble(World *world, Flood_Fill *ff, Allocator *allo
     assembler.triangle_art.create();
 #endif
 
-    for(auto &root_entry : assembler.world->root_bvh_entries) {
-        assemble_triangle(&assembler, &root_entry);
+    // :AssemblySlices
+    // The triangles of this slice.
+    s64 root_count  = assembler.world->root_bvh_entries.count;
+    s64 entry_count = assembler.world->bvh.entries.count;
+    u32 first_root  = (u32) (root_count * slice / slice_count);
+    u32 end_root    = (u32) (root_count * (slice + 1) / slice_count);
+    s64 first_entry = entry_count * slice / slice_count;
+    s64 end_entry   = entry_count * (slice + 1) / slice_count;
+
+    // :RootPlanesBVH
+    // Only look at the faces which the region actually touches, and on these only at the tiles below the
+    // region's bounds. Going tile by tile also means that consecutive triangles are close to each other, so
+    // that their rays mostly visit the same BVH nodes.
+    for(s64 face = 0; face < ARRAY_COUNT(assembler.world->root_face_indices); ++face) {
+        s64 axis = face / 2;
+        real face_position = (face % 2) ? assembler.world->half_size.values[axis] : -assembler.world->half_size.values[axis];
+        if(face_position < region_min.values[axis] || face_position > region_max.values[axis]) continue;
+
+        Root_Face_Index *index = &assembler.world->root_face_indices[face];
+        s64 first_tile = assembler.world->get_root_face_tile(face, region_min);
+        s64 last_tile  = assembler.world->get_root_face_tile(face, region_max);
+
+        for(s64 y = first_tile / ROOT_FACE_GRID_SIZE; y <= last_tile / ROOT_FACE_GRID_SIZE; ++y) {
+            for(s64 x = first_tile % ROOT_FACE_GRID_SIZE; x <= last_tile % ROOT_FACE_GRID_SIZE; ++x) {
+                s64 tile = y * ROOT_FACE_GRID_SIZE + x;
+                u32 first = max(index->tile_offsets[tile], first_root);
+                u32 end   = min(index->tile_offsets[tile + 1], end_root);
+                for(u32 i = first; i < end; ++i) {
+                    assemble_triangle(&assembler, &assembler.world->root_bvh_entries[i]);
+                }
+            }
+        }
     }
         
-    for(s64 i = 0; i < assembler.world->bvh.entries.count; ++i) {
-        assemble_triangle(&assembler, &assembler.world->bvh.entries[i]);
+    for(s64 i = first_entry; i < end_entry; ++i) {
+        BVH_Entry *entry = &assembler.world->bvh.entries[i];
+        if(entry->removed) continue; // :BVHRemovedEntries
+        assemble_triangle(&assembler, entry);
     }
 
 #if USE_HASH_TABLE_IN_ASSEMBLER && FOUNDATION_DEVELOPER
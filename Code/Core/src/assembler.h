@@ -6,4 +6,8 @@
 struct World;
 struct Flood_Fill;
 
-Resizable_Array<Triangle> assemble(World *world, Flood_Fill *ff, Allocator *allocator);
+// :AssemblySlices
+// The candidate triangles (root triangles and delimiter triangles) can be split into slice_count slices of
+// consecutive triangles, so that one large region can be assembled by several jobs at once. Every triangle
+// belongs to exactly one slice, so concatenating the volumes of all slices gives the full volume.
+Resizable_Array<Triangle> assemble(World *world, Flood_Fill *ff, Allocator *allocator, s64 slice = 0, s64 slice_count = 1);
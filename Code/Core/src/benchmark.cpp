@@ -0,0 +1,140 @@
+#include "../bindings/bindings.h"
+#include "serialized_setup.cpp"
+#include "world.h"
+#include "bvh.h"
+#include "floodfill.h"
+#include "os_specific.h"
+#include "memutils.h"
+
+//
+// Compares all BVH builders on the serialized Unity scene and the developer test scenes. Every scene is set
+// up (and its volumes calculated) as usual, after which the rays of the flood fill get recorded once by
+// calculating the blocked cell edges again (see :CellEdgeMask). The world's BVH triangles are then rebuilt with every split method,
+// and the recorded rays are replayed against each of these BVHs. Since all builders must agree on which rays
+// are occluded, the flood fill would cast exactly the same rays with any of them.
+//
+// This is built as its own executable in the Benchmark configuration, since it replaces demo.cpp's main.
+//
+
+struct Benchmark_Scene {
+    const char *name;
+    World_Handle (*setup)();
+};
+
+struct Benchmark_Variant {
+    const char *name;
+    BVH_Split_Method split_method;
+};
+
+static Benchmark_Scene benchmark_scenes[] = {
+    { "Unity Town",   setup_world },
+    { "House",        core_do_house_test },
+    { "BVH",          core_do_bvh_test },
+    { "Large Volumes", core_do_large_volumes_test },
+    { "Cutout",       core_do_cutout_test },
+    { "Circle",       core_do_circle_test },
+    { "U Shape",      core_do_u_shape_test },
+    { "Center Block", core_do_center_block_test },
+    { "Gallery",      core_do_gallery_test },
+    { "Louvre",       core_do_louvre_test },
+};
+
+static Benchmark_Variant benchmark_variants[] = {
+    { "Midpoint",    BVH_SPLIT_Midpoint },
+    { "Binned SAH",  BVH_SPLIT_Binned_SAH },
+    { "Morton",      BVH_SPLIT_Morton },
+    { "Spatial SAH", BVH_SPLIT_Spatial_SAH },
+};
+
+static
+void record_flood_fill_rays(World *world, Resizable_Array<BVH_Ray> *rays) {
+    // Scenes which never calculated their volumes don't have any flood fill to record.
+    if(world->cell_world_space_size <= 0.) return;
+
+    Cell_Grid grid;
+    create_cell_grid(&grid, world, Default_Allocator, world->cell_world_space_size);
+    calculate_blocked_cell_edges(&grid, 0, grid.brick_count - 1, rays);
+    destroy_cell_grid(&grid);
+
+    //
+    // Rays which leave the world never reach the BVH in World::cast_ray_against_delimiters_and_root_planes,
+    // so drop them here to only measure the BVH's share of the work.
+    //
+    s64 bvh_ray_count = 0;
+    for(s64 i = 0; i < rays->count; ++i) {
+        BVH_Ray &ray = (*rays)[i];
+        if(!world->ray_exits_world_bounds(ray.origin, ray.direction, ray.max_distance)) (*rays)[bvh_ray_count++] = ray;
+    }
+
+    rays->count = bvh_ray_count;
+}
+
+static
+void benchmark_variant(World *world, Benchmark_Variant *variant, Resizable_Array<BVH_Ray> *rays, s64 *expected_occluded_count) {
+    BVH bvh;
+    bvh.create(Default_Allocator, variant->split_method);
+
+    for(BVH_Entry &entry : world->bvh.entries) {
+        if(!entry.removed) bvh.add(entry.triangle, entry.owner);
+    }
+
+    Hardware_Time build_start = os_get_hardware_time();
+    bvh.subdivide();
+    Hardware_Time build_end = os_get_hardware_time();
+
+    BVH_Stats stats = bvh.stats(true);
+
+    // Time the rays without the counters, and then replay them again to count the visited nodes.
+    s64 occluded_count = 0;
+    Hardware_Time trace_start = os_get_hardware_time();
+
+    for(BVH_Ray &ray : *rays) {
+        if(bvh.occluded(ray.origin, ray.direction, ray.max_distance)) ++occluded_count;
+    }
+
+    Hardware_Time trace_end = os_get_hardware_time();
+
+    BVH_Traversal_Counters counters = { 0 };
+    for(BVH_Ray &ray : *rays) bvh.occluded(ray.origin, ray.direction, ray.max_distance, &counters);
+
+    real ray_count = (real) max(counters.ray_count, 1);
+
+    printf("  %-12s | %8.2fms | %6" PRId64 " | %6" PRId64 " | %3" PRId64 " | %8.3f | %8.3f | %8.3f | %8.2f | %8.2f | %8.2fms",
+           variant->name,
+           os_convert_hardware_time(build_end - build_start, Milliseconds),
+           stats.total_node_count, stats.total_reference_count, stats.max_leaf_depth,
+           stats.sah_cost, stats.overlap_cost, stats.epo_cost,
+           counters.node_visits / ray_count, counters.triangle_tests / ray_count,
+           os_convert_hardware_time(trace_end - trace_start, Milliseconds));
+
+    // All builders must agree on the result, otherwise the comparison is meaningless.
+    if(*expected_occluded_count < 0) *expected_occluded_count = occluded_count;
+    if(occluded_count != *expected_occluded_count) printf("  <- MISMATCH: %" PRId64 " occluded rays, expected %" PRId64 ".", occluded_count, *expected_occluded_count);
+
+    printf("\n");
+
+    bvh.destroy();
+}
+
+int main() {
+    for(Benchmark_Scene &scene : benchmark_scenes) {
+        World *world = (World *) scene.setup();
+
+        Resizable_Array<BVH_Ray> rays;
+        rays.allocator = Default_Allocator;
+        record_flood_fill_rays(world, &rays);
+
+        printf("=== %s: %" PRId64 " triangles, %" PRId64 " recorded rays ===\n", scene.name, world->bvh.entries.count, rays.count);
+        printf("  %-12s | %10s | %6s | %6s | %3s | %8s | %8s | %8s | %8s | %8s | %10s\n", "Builder", "Build", "Nodes", "Refs", "Dep", "SAH", "Overlap", "EPO", "Nodes/R", "Tris/R", "Trace");
+
+        s64 expected_occluded_count = -1;
+        for(Benchmark_Variant &variant : benchmark_variants) benchmark_variant(world, &variant, &rays, &expected_occluded_count);
+
+        printf("\n");
+
+        rays.clear();
+        core_destroy_world(world);
+    }
+
+    return 0;
+}
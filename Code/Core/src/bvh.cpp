@@ -3,9 +3,95 @@
 #include "timing.h"
 #include "math/intersect.h"
 
+#define BVH_RADIX_BITS    8
+#define BVH_RADIX_BUCKETS (1 << BVH_RADIX_BITS)
+
 struct BVH_Node_Stack {
-    BVH_Node *node;
+    u32 node_index;
+    u32 depth;
+};
+
+struct BVH_Subtree_Job {
+    BVH *bvh;
+    u32 node_index; // The node in the BVH's node array which this job subdivides.
     u32 depth;
+
+    // Each job builds its subtree into its own node storage, which gets stitched into the BVH's node array
+    // after all jobs have finished. The first node is the root of the subtree.
+    BVH_Node *nodes;
+    s64 node_count;
+};
+
+struct BVH_Packet_Traversal_Entry {
+    u32 node_index;
+    u32 ray_mask; // The rays of the packet which hit this node.
+};
+
+struct BVH_Morton_Key {
+    u64 code;
+    u32 reference_index;
+};
+
+struct BVH_Morton_Job {
+    BVH *bvh;
+    s64 first, one_plus_last; // The chunk of keys (and references) handled by this job.
+    
+    // Calculating the codes.
+    vec3 centroid_min;
+    vec3 centroid_scale;
+
+    // Sorting the codes.
+    BVH_Morton_Key *source;
+    BVH_Morton_Key *destination;
+    s64 shift;
+    s64 offsets[BVH_RADIX_BUCKETS]; // First the histogram of this chunk, then the position in the destination for each bucket.
+};
+
+struct BVH_Traversal_Entry {
+    u32 node_index;
+    real distance; // The distance along the ray at which the node's bounds were entered.
+};
+
+struct BVH_Collapse_Stack {
+    u32 binary_index;
+    u32 wide_index;
+};
+
+struct BVH_SAH_Bin {
+    vec3 min, max;
+    s64 entry_count;
+};
+
+struct BVH_Spatial_Bin {
+    vec3 min, max;
+    s64 enter_count; // The number of references which start in this bin.
+    s64 exit_count;  // The number of references which end in this bin.
+};
+
+struct BVH_Split {
+    b8 valid;
+    s64 axis; // x = 0, y = 1, z = 2
+
+    // BVH_SPLIT_Midpoint: References with a center above this value go into the right child.
+    real value;
+
+    // BVH_SPLIT_Binned_SAH: References whose center falls into a bin at or after the first_right_bin go into
+    // the right child. We partition by bin index instead of by a split value so that the partitioning exactly
+    // matches the binning which the cost was evaluated on.
+    real centroid_min;
+    real bin_scale;
+    s64 first_right_bin;
+    real cost;
+    vec3 left_min, left_max, right_min, right_max; // The bounds of the children, to detect overlapping children.
+
+    // BVH_SPLIT_Morton: The references are already sorted, so this is the first reference of the right child.
+    s64 first_right_reference;
+
+    // BVH_SPLIT_Spatial_SAH: References which end before the first_right_bin go into the left child, references
+    // which start at or after it go into the right child. All others get clipped at the position and end up
+    // in both children. Here, the bins cover the node's bounds and not the centers.
+    b8 spatial;
+    real position;
 };
 
 static inline
@@ -49,19 +135,435 @@ void include_in_bounds(vec3 &min, vec3 &max, const Triangle &triangle) {
     include_in_max_bounds(max, triangle.p2);
 }
 
+static inline
+f32 round_down_to_f32(real value) {
+    // Round towards negative infinity instead of to the nearest value, so that the bounds stay conservative.
+    f32 result = (f32) value;
+    if(result > value) result = nextafterf(result, MIN_F32);
+    return result;
+}
+
+static inline
+f32 round_up_to_f32(real value) {
+    f32 result = (f32) value;
+    if(result < value) result = nextafterf(result, MAX_F32);
+    return result;
+}
+
+static inline
+real aabb_surface_area(const vec3 &min, const vec3 &max) {
+    vec3 delta = max - min;
+    return 2. * (delta.x * delta.y + delta.y * delta.z + delta.z * delta.x);
+}
+
+static inline
+s64 get_sah_bin_index(real centroid, real centroid_min, real bin_scale) {
+    s64 index = (s64) ((centroid - centroid_min) * bin_scale);
+    return clamp(index, 0, BVH_SAH_BIN_COUNT - 1);
+}
+
+static inline
+vec3 get_reference_center(BVH_Reference *reference) {
+    return (reference->min + reference->max) * .5;
+}
+
+static inline
+b8 bounds_are_valid(const vec3 &min, const vec3 &max) {
+    return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+}
+
+static
+void find_midpoint_split(BVH_Node *node, BVH_Split *split) {
+    vec3 size = node->max - node->min;
+
+    if(size.x > size.y && size.x > size.z) {
+        split->axis = 0;
+    } else if(size.y > size.z) {
+        split->axis = 1;
+    } else {
+        split->axis = 2;
+    }
+
+    real percentage_along_split_axis = 0.5;
+    split->value = node->min.values[split->axis] + (node->max.values[split->axis] - node->min.values[split->axis]) * percentage_along_split_axis;
+    split->valid = true;
+}
+
+static
+void find_binned_sah_split(BVH_Reference *references, s64 reference_count, BVH_Node *node, BVH_Split *split) {
+    split->valid   = false;
+    split->spatial = false;
+    split->cost    = MAX_F32;
+
+    //
+    // We bin the references by their center instead of their bounds, since the center is what decides which
+    // child a reference ends up in.
+    //
+    vec3 centroid_min = vec3(MAX_F32, MAX_F32, MAX_F32);
+    vec3 centroid_max = vec3(MIN_F32, MIN_F32, MIN_F32);
+
+    for(s64 i = 0; i < reference_count; ++i) {
+        vec3 center = get_reference_center(&references[i]);
+        include_in_min_bounds(centroid_min, center);
+        include_in_max_bounds(centroid_max, center);
+    }
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        real extent = centroid_max.values[axis] - centroid_min.values[axis];
+        if(extent <= CORE_SMALL_EPSILON) continue; // All centers lie on a plane along this axis, so there is nothing to split here.
+
+        real bin_scale = BVH_SAH_BIN_COUNT / extent;
+
+        BVH_SAH_Bin bins[BVH_SAH_BIN_COUNT];
+        for(s64 i = 0; i < BVH_SAH_BIN_COUNT; ++i) {
+            bins[i].min         = vec3(MAX_F32, MAX_F32, MAX_F32);
+            bins[i].max         = vec3(MIN_F32, MIN_F32, MIN_F32);
+            bins[i].entry_count = 0;
+        }
+
+        for(s64 i = 0; i < reference_count; ++i) {
+            BVH_Reference *reference = &references[i];
+            s64 bin_index = get_sah_bin_index(get_reference_center(reference).values[axis], centroid_min.values[axis], bin_scale);
+            include_in_min_bounds(bins[bin_index].min, reference->min);
+            include_in_max_bounds(bins[bin_index].max, reference->max);
+            ++bins[bin_index].entry_count;
+        }
+
+        //
+        // Sweep once from the left to gather the area and count of everything left of each split plane,
+        // then sweep from the right and evaluate the cost of every plane on the way.
+        //
+        vec3 left_min[BVH_SAH_BIN_COUNT - 1], left_max[BVH_SAH_BIN_COUNT - 1];
+        s64 left_count[BVH_SAH_BIN_COUNT - 1];
+
+        {
+            vec3 min = vec3(MAX_F32, MAX_F32, MAX_F32), max = vec3(MIN_F32, MIN_F32, MIN_F32);
+            s64 count = 0;
+
+            for(s64 i = 0; i < BVH_SAH_BIN_COUNT - 1; ++i) {
+                if(bins[i].entry_count) {
+                    include_in_min_bounds(min, bins[i].min);
+                    include_in_max_bounds(max, bins[i].max);
+                    count += bins[i].entry_count;
+                }
+
+                left_min[i]   = min;
+                left_max[i]   = max;
+                left_count[i] = count;
+            }
+        }
+
+        {
+            vec3 min = vec3(MAX_F32, MAX_F32, MAX_F32), max = vec3(MIN_F32, MIN_F32, MIN_F32);
+            s64 count = 0;
+
+            for(s64 i = BVH_SAH_BIN_COUNT - 1; i > 0; --i) {
+                if(bins[i].entry_count) {
+                    include_in_min_bounds(min, bins[i].min);
+                    include_in_max_bounds(max, bins[i].max);
+                    count += bins[i].entry_count;
+                }
+
+                if(!count || !left_count[i - 1]) continue; // Don't allow empty children.
+
+                real cost = aabb_surface_area(left_min[i - 1], left_max[i - 1]) * left_count[i - 1] + aabb_surface_area(min, max) * count;
+                if(cost < split->cost) {
+                    split->valid           = true;
+                    split->cost            = cost;
+                    split->axis            = axis;
+                    split->centroid_min    = centroid_min.values[axis];
+                    split->bin_scale       = bin_scale;
+                    split->first_right_bin = i;
+                    split->left_min        = left_min[i - 1];
+                    split->left_max        = left_max[i - 1];
+                    split->right_min       = min;
+                    split->right_max       = max;
+                }
+            }
+        }
+    }
+
+    if(split->valid) {
+        // Normalize the cost so that it is comparable to the cost of just keeping this node as a leaf.
+        real node_area = node->surface_area();
+        split->cost = BVH_SAH_TRAVERSAL_COST + BVH_SAH_INTERSECTION_COST * (node_area > 0. ? split->cost / node_area : split->cost);
+    }
+}
+
+static inline
+b8 reference_belongs_in_right_child(BVH_Split_Method method, BVH_Split *split, BVH_Reference *reference) {
+    real center = get_reference_center(reference).values[split->axis];
+
+    if(method == BVH_SPLIT_Binned_SAH || method == BVH_SPLIT_Spatial_SAH) {
+        return get_sah_bin_index(center, split->centroid_min, split->bin_scale) >= split->first_right_bin;
+    } else {
+        return center > split->value;
+    }
+}
+
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV1A_PRIME        0x100000001b3ull
+
+static
+u64 fnv1a_hash(u64 hash, const void *data, s64 size) {
+    const u8 *bytes = (const u8 *) data;
+    for(s64 i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV1A_PRIME;
+    }
+
+    return hash;
+}
+
+static inline
+s64 align_blob_offset(s64 offset) {
+    return (offset + BVH_BLOB_ALIGNMENT - 1) & ~((s64) BVH_BLOB_ALIGNMENT - 1);
+}
+
+static
+u32 get_blob_layout() {
+    u64 sizes[] = { sizeof(real), sizeof(void *), sizeof(BVH_Node), sizeof(BVH_Wide_Node), sizeof(BVH_Entry), sizeof(BVH_Reference), sizeof(BVH_Triangle_Block) };
+    return (u32) fnv1a_hash(FNV1A_OFFSET_BASIS, sizes, sizeof(sizes));
+}
+
+static
+BVH_Blob_Section write_blob_section(u8 *blob, s64 *offset, const void *data, s64 count, s64 element_size) {
+    BVH_Blob_Section section;
+    section.offset = *offset;
+    section.count  = count;
+    if(count) memcpy(blob + *offset, data, count * element_size);
+    *offset += align_blob_offset(count * element_size);
+    return section;
+}
+
+static
+b8 blob_section_is_valid(const BVH_Blob_Header *header, BVH_Blob_Section section, s64 element_size) {
+    if(section.offset % BVH_BLOB_ALIGNMENT != 0 || section.offset > header->total_size) return false;
+    return section.count <= (header->total_size - section.offset) / element_size;
+}
+
+static
+b8 blob_leaf_is_valid(const BVH_Blob_Header *header, u32 first_index, u32 entry_count) {
+    return (u64) first_index + (u64) entry_count <= header->references.count;
+}
+
+static
+b8 blob_tree_is_valid(const BVH_Blob_Header *header, const BVH_Node *nodes) {
+    // The traversals use fixed-size stacks which assume that the tree is no deeper than the depth in the
+    // header, so the binary tree is walked once to make sure that it really is a tree of that depth. A
+    // corrupted child link could otherwise make the traversal loop forever or overflow its stack.
+    if(!header->nodes.count) return true;
+
+    u32 stack[BVH_BINARY_STACK_SIZE];
+    u32 stack_levels[BVH_BINARY_STACK_SIZE];
+    s64 stack_count = 0;
+    u64 visited_nodes = 0;
+
+    stack[stack_count] = 0;
+    stack_levels[stack_count] = 1;
+    ++stack_count;
+
+    while(stack_count) {
+        --stack_count;
+        const BVH_Node *node = &nodes[stack[stack_count]];
+        u32 level = stack_levels[stack_count];
+
+        if(level > header->depth || ++visited_nodes > header->nodes.count) return false;
+        if(node->entry_count) continue;
+
+        if(stack_count + 2 > BVH_BINARY_STACK_SIZE) return false;
+        stack[stack_count] = node->first_index + 1;
+        stack_levels[stack_count] = level + 1;
+        ++stack_count;
+        stack[stack_count] = node->first_index + 0;
+        stack_levels[stack_count] = level + 1;
+        ++stack_count;
+    }
+
+    return true;
+}
+
+static
+b8 blob_wide_tree_is_valid(const BVH_Blob_Header *header, const BVH_Wide_Node *wide_nodes) {
+    // Collapsing never makes the tree deeper, so the same depth bound applies to the wide nodes.
+    if(!header->wide_nodes.count) return true;
+
+    u32 stack[BVH_WIDE_STACK_SIZE];
+    u32 stack_levels[BVH_WIDE_STACK_SIZE];
+    s64 stack_count = 0;
+    u64 visited_nodes = 0;
+
+    stack[stack_count] = 0;
+    stack_levels[stack_count] = 1;
+    ++stack_count;
+
+    while(stack_count) {
+        --stack_count;
+        const BVH_Wide_Node *node = &wide_nodes[stack[stack_count]];
+        u32 level = stack_levels[stack_count];
+
+        if(level > header->depth || ++visited_nodes > header->wide_nodes.count) return false;
+
+        for(s64 i = 0; i < BVH_WIDTH; ++i) {
+            if(node->entry_count[i] || node->first_index[i] == BVH_INVALID_INDEX) continue;
+
+            if(stack_count + 1 > BVH_WIDE_STACK_SIZE) return false;
+            stack[stack_count] = node->first_index[i];
+            stack_levels[stack_count] = level + 1;
+            ++stack_count;
+        }
+    }
+
+    return true;
+}
+
+static
+b8 blob_indices_are_valid(const void *blob, const BVH_Blob_Header *header) {
+    //
+    // The sections themselves are known to lie inside the blob at this point, but the indices stored in them
+    // are not. Check every link once before adopting the arrays, so that a corrupted or truncated cache file
+    // gets rejected here instead of making the traversal read out of bounds.
+    //
+    const u8 *bytes = (const u8 *) blob;
+    const BVH_Node *nodes           = (const BVH_Node *)      (bytes + header->nodes.offset);
+    const BVH_Wide_Node *wide_nodes = (const BVH_Wide_Node *) (bytes + header->wide_nodes.offset);
+    const BVH_Reference *references = (const BVH_Reference *) (bytes + header->references.offset);
+
+    for(u64 i = 0; i < header->nodes.count; ++i) {
+        const BVH_Node *node = &nodes[i];
+        if(node->entry_count) {
+            if(!blob_leaf_is_valid(header, node->first_index, node->entry_count)) return false;
+        } else {
+            if((u64) node->first_index + 1 >= header->nodes.count) return false;
+        }
+    }
+
+    for(u64 i = 0; i < header->wide_nodes.count; ++i) {
+        const BVH_Wide_Node *node = &wide_nodes[i];
+
+        for(s64 j = 0; j < BVH_WIDTH; ++j) {
+            if(node->entry_count[j]) {
+                if(!blob_leaf_is_valid(header, node->first_index[j], node->entry_count[j])) return false;
+            } else if(node->first_index[j] == BVH_INVALID_INDEX) {
+                // Unused slots must never be hit by a ray, which the inverted bounds guarantee.
+                if(!(node->bounds[0][j] > node->bounds[AXIS_COUNT][j])) return false;
+            } else {
+                if(node->first_index[j] >= header->wide_nodes.count) return false;
+            }
+        }
+    }
+
+    for(u64 i = 0; i < header->references.count; ++i) {
+        if(references[i].entry_index >= header->entries.count) return false;
+    }
+
+    // The leaf tests read whole triangle blocks, one per BVH_TRIANGLE_BLOCK_WIDTH references.
+    if(header->triangle_blocks.count != (header->references.count + BVH_TRIANGLE_BLOCK_WIDTH - 1) / BVH_TRIANGLE_BLOCK_WIDTH) return false;
+
+    return blob_tree_is_valid(header, nodes) && blob_wide_tree_is_valid(header, wide_nodes);
+}
+
+static
+u64 encode_blob_owner(BVH *bvh, void *owner, BVH_Owner_To_Id owner_to_id, void *user_data) {
+    // A BVH which was itself mapped from a blob still has the encoded owner ids in its entries.
+    if(bvh->blob) return (u64) (size_t) owner;
+    return (owner && owner_to_id) ? owner_to_id(owner, user_data) + 1 : 0;
+}
+
+template<typename T>
+static
+void map_blob_section(Resizable_Array<T> &array, const void *blob, BVH_Blob_Section section) {
+    array.data  = (T *) ((const u8 *) blob + section.offset);
+    array.count = (s64) section.count;
+}
+
+template<typename T>
 static
-void find_leafs_at_position_helper(Resizable_Array<BVH_Node *> &result, BVH_Node *node, vec3 position) {
-    b8 outside_aabb = position.x < node->min.x || position.y < node->min.y || position.z < node->min.z ||
-            position.x > node->max.x || position.y > node->max.y || position.z > node->max.z;
+void copy_blob_section(Resizable_Array<T> &array, Allocator *allocator) {
+    T *mapped_data   = array.data;
+    s64 mapped_count = array.count;
+
+    array           = Resizable_Array<T>();
+    array.allocator = allocator;
+
+    if(mapped_count) {
+        array.reserve(mapped_count);
+        memcpy(array.data, mapped_data, mapped_count * sizeof(T));
+        array.count = mapped_count;
+    }
+}
 
-    if(outside_aabb) return;
+static
+b8 accumulate_epo_cost(BVH *bvh, u32 node_index, vec3 point, u32 entry_index, real *cost) {
+    //
+    // Visits all nodes containing the point, and adds the cost of those whose subtree doesn't reference the
+    // entry the point was sampled from. Returns whether the subtree references the entry. Subtrees which
+    // don't contain the point can never reference the part of the triangle around it, so they are skipped.
+    //
+    BVH_Node *node = &bvh->nodes[node_index];
+    if(point.x < node->min.x || point.y < node->min.y || point.z < node->min.z || point.x > node->max.x || point.y > node->max.y || point.z > node->max.z) return false;
+
+    b8 contains_entry = false;
+
+    if(node->is_leaf()) {
+        for(s64 i = node->first_index; i < node->first_index + node->entry_count; ++i) {
+            if(bvh->references[i].entry_index == entry_index) contains_entry = true;
+        }
 
-    if(node->leaf) {
-        result.add(node);
+        if(!contains_entry) *cost += BVH_SAH_INTERSECTION_COST * node->entry_count;
     } else {
-        if(node->children[0]) find_leafs_at_position_helper(result, node->children[0], position);
-        if(node->children[1]) find_leafs_at_position_helper(result, node->children[1], position);
+        b8 left  = accumulate_epo_cost(bvh, node->first_index + 0, point, entry_index, cost);
+        b8 right = accumulate_epo_cost(bvh, node->first_index + 1, point, entry_index, cost);
+        contains_entry = left || right;
+
+        if(!contains_entry) *cost += BVH_SAH_TRAVERSAL_COST;
+    }
+
+    return contains_entry;
+}
+
+static
+real estimate_epo_cost(BVH *bvh) {
+    //
+    // https://research.nvidia.com/publication/2013-09_fast-parallel-construction-high-quality-bounding-volume-hierarchies
+    // The exact EPO clips every triangle against every node it overlaps. Instead, we sample a few fixed
+    // points on every triangle and weigh each by its share of the triangle's area, which is accurate enough
+    // to compare builders against each other.
+    //
+    const real barycentrics[][3] = { { 1. / 3., 1. / 3., 1. / 3. }, { 2. / 3., 1. / 6., 1. / 6. }, { 1. / 6., 2. / 3., 1. / 6. }, { 1. / 6., 1. / 6., 2. / 3. } };
+
+    real weighted_cost = 0.;
+    real total_area    = 0.;
+
+    for(s64 i = 0; i < bvh->entries.count; ++i) {
+        BVH_Entry *entry = &bvh->entries[i];
+        if(entry->removed) continue;
+
+        Triangle &triangle = entry->triangle;
+        real area = v3_length(v3_cross_v3(triangle.p1 - triangle.p0, triangle.p2 - triangle.p0)) * .5;
+        if(area <= 0.) continue;
+
+        for(s64 j = 0; j < ARRAY_COUNT(barycentrics); ++j) {
+            vec3 point = triangle.p0 * barycentrics[j][0] + triangle.p1 * barycentrics[j][1] + triangle.p2 * barycentrics[j][2];
+            real cost = 0.;
+            accumulate_epo_cost(bvh, 0, point, (u32) i, &cost);
+            weighted_cost += cost * area / (real) ARRAY_COUNT(barycentrics);
+        }
+
+        total_area += area;
     }
+
+    return total_area > 0. ? weighted_cost / total_area : 0.;
+}
+
+static
+BVH_Leaf_Iterator make_leaf_iterator(BVH *bvh, BVH_Query query) {
+    BVH_Leaf_Iterator iterator;
+    iterator.bvh         = bvh;
+    iterator.query       = query;
+    iterator.stack_count = 0;
+    if(bvh->nodes.count) iterator.stack[iterator.stack_count++] = 0;
+    return iterator;
 }
 
 
@@ -73,13 +575,17 @@ void BVH_Stats::print_to_stdout() {
     printf("  Max Leaf Entries:  %" PRId64 "\n", this->max_entries_in_leaf);
     printf("  Total Node Count:  %" PRId64 "\n", this->total_node_count);
     printf("  Total Entry Count: %" PRId64 "\n", this->total_entry_count);
+    printf("  Total References:  %" PRId64 "\n", this->total_reference_count);
     printf("  AVG Fill Rate:     %f\n", this->total_entry_count / (f32) this->total_node_count);
     printf("  AVG Shrinkage:     %f\n", this->average_shrinkage);
+    printf("  SAH Cost:          %f\n", this->sah_cost);
+    printf("  Overlap Cost:      %f\n", this->overlap_cost);
+    printf("  EPO Cost:          %f\n", this->epo_cost);
     printf("================== BVH ==================\n");
 
 }
 
-void BVH_Node::update_stats(BVH_Node *parent, BVH_Stats *stats, s64 depth) {
+void BVH_Node::update_stats(BVH *bvh, BVH_Node *parent, BVH_Stats *stats, s64 depth) {
     ++stats->total_node_count;
 
     if(parent) {
@@ -88,14 +594,22 @@ void BVH_Node::update_stats(BVH_Node *parent, BVH_Stats *stats, s64 depth) {
         stats->average_shrinkage += shrinkage;
     }
     
-    if(this->leaf) {
+    if(this->is_leaf()) {
+        stats->sah_cost           += BVH_SAH_INTERSECTION_COST * this->entry_count * this->surface_area();
         stats->max_leaf_depth      = max(stats->max_leaf_depth, depth);
         stats->min_leaf_depth      = min(stats->min_leaf_depth, depth);
-        stats->max_entries_in_leaf = max(stats->max_entries_in_leaf, this->entry_count);
-        stats->min_entries_in_leaf = min(stats->min_entries_in_leaf, this->entry_count);
+        stats->max_entries_in_leaf = max(stats->max_entries_in_leaf, (s64) this->entry_count);
+        stats->min_entries_in_leaf = min(stats->min_entries_in_leaf, (s64) this->entry_count);
     } else {
-        if(this->children[0]) this->children[0]->update_stats(this, stats, depth + 1);
-        if(this->children[1]) this->children[1]->update_stats(this, stats, depth + 1);
+        BVH_Node *left  = &bvh->nodes[this->first_index + 0];
+        BVH_Node *right = &bvh->nodes[this->first_index + 1];
+        vec3 overlap_min = vec3(max(left->min.x, right->min.x), max(left->min.y, right->min.y), max(left->min.z, right->min.z));
+        vec3 overlap_max = vec3(min(left->max.x, right->max.x), min(left->max.y, right->max.y), min(left->max.z, right->max.z));
+        if(bounds_are_valid(overlap_min, overlap_max)) stats->overlap_cost += aabb_surface_area(overlap_min, overlap_max);
+
+        stats->sah_cost += BVH_SAH_TRAVERSAL_COST * this->surface_area();
+        bvh->nodes[this->first_index + 0].update_stats(bvh, this, stats, depth + 1);
+        bvh->nodes[this->first_index + 1].update_stats(bvh, this, stats, depth + 1);
     }
 }
 
@@ -104,228 +618,1993 @@ real BVH_Node::volume() {
     return delta.x * delta.y * delta.z;
 }
 
-void BVH::create(Allocator *allocator) {
+real BVH_Node::surface_area() {
+    return aabb_surface_area(this->min, this->max);
+}
+
+void BVH::create(Allocator *allocator, BVH_Split_Method split_method) {
     this->allocator         = allocator;
+    this->split_method      = split_method;
     this->entries           = Resizable_Array<BVH_Entry>();
     this->entries.allocator = allocator;
+    this->references        = Resizable_Array<BVH_Reference>();
+    this->references.allocator = allocator;
+    this->nodes             = Resizable_Array<BVH_Node>();
+    this->nodes.allocator   = allocator;
+    this->wide_nodes        = Resizable_Array<BVH_Wide_Node>();
+    this->wide_nodes.allocator = allocator;
+    this->depth             = 0;
+    this->triangle_blocks   = Resizable_Array<BVH_Triangle_Block>();
+    this->triangle_blocks.allocator = allocator;
+    this->blob              = null;
+    this->blob_owners       = null;
+    this->blob_owner_count  = 0;
+}
+
+void BVH::destroy() {
+    if(this->blob) {
+        // The arrays point into the blob, which is owned by whoever mapped it.
+        this->create(this->allocator, this->split_method);
+        return;
+    }
 
-    memset(this->root.children, 0, sizeof(this->root.children));
+    this->entries.clear();
+    this->references.clear();
+    this->nodes.clear();
+    this->wide_nodes.clear();
+    this->triangle_blocks.clear();
+    this->depth = 0;
 }
 
-void BVH::add(Triangle triangle) {
+void BVH::add(Triangle triangle, void *owner) {
+    this->detach_from_blob();
+
     BVH_Entry *entry = this->entries.push();
     entry->triangle  = triangle;
     entry->center    = triangle.center();
+    entry->owner     = owner;
+    entry->removed   = false;
 }
 
-void BVH::subdivide() {
-    Resizable_Array<BVH_Node_Stack> stack;
-    stack.allocator = this->allocator;
-    stack.add({ &this->root, 1 });
+static inline
+void include_in_bounds(vec3 &min, vec3 &max, const vec3 &other_min, const vec3 &other_max) {
+    include_in_min_bounds(min, other_min);
+    include_in_max_bounds(max, other_max);
+}
 
-    this->root.first_entry_index = 0;
-    this->root.entry_count       = this->entries.count;
+static
+BVH_Reference make_reference(BVH *bvh, u32 entry_index) {
+    BVH_Reference reference;
+    reference.min         = vec3(MAX_F32, MAX_F32, MAX_F32);
+    reference.max         = vec3(MIN_F32, MIN_F32, MIN_F32);
+    reference.entry_index = entry_index;
+    reference.morton_code = 0;
+    include_in_bounds(reference.min, reference.max, bvh->entries[entry_index].triangle);
+    return reference;
+}
 
-    while(stack.count) {
-        BVH_Node_Stack head = stack.pop();
+static
+void refit_interior_node(BVH *bvh, BVH_Node *node) {
+    BVH_Node *left  = &bvh->nodes[node->first_index + 0];
+    BVH_Node *right = &bvh->nodes[node->first_index + 1];
+    node->min = left->min;
+    node->max = left->max;
+    include_in_bounds(node->min, node->max, right->min, right->max);
+}
 
-        //
-        // Calculate the bounds for this node.
-        //
-        {
-            head.node->leaf = true;
-            head.node->min = vec3(MAX_F32, MAX_F32, MAX_F32);
-            head.node->max = vec3(MIN_F32, MIN_F32, MIN_F32);
-
-            s64 one_plus_last = head.node->first_entry_index + head.node->entry_count;
-            for(s64 i = head.node->first_entry_index; i < one_plus_last; ++i) {
-                BVH_Entry &entry = this->entries[i];
-                include_in_bounds(head.node->min, head.node->max, entry.triangle);
-            }
+static
+b8 refit_node(BVH *bvh, u32 node_index) {
+    //
+    // Recomputes the bounds of this subtree from the references, and prunes all subtrees which only contain
+    // removed entries by pulling their sibling up into the parent. Returns false if this entire subtree
+    // is empty.
+    // The pruned nodes stay in the node array, but are no longer referenced. They get cleaned up on the next
+    // full subdivide.
+    //
+    BVH_Node *node = &bvh->nodes[node_index];
+
+    if(node->is_leaf()) {
+        node->min = vec3(MAX_F32, MAX_F32, MAX_F32);
+        node->max = vec3(MIN_F32, MIN_F32, MIN_F32);
+
+        b8 alive = false;
+        s64 one_plus_last = node->first_index + node->entry_count;
+        for(s64 i = node->first_index; i < one_plus_last; ++i) {
+            BVH_Reference &reference = bvh->references[i];
+            if(bvh->entries[reference.entry_index].removed) continue;
+            include_in_bounds(node->min, node->max, reference.min, reference.max);
+            alive = true;
         }
+        
+        return alive;
+    }
 
-        //
-        // Only subdivide this node if we haven't reached the max node depth yet and this node actually contains
-        // enough entries that splitting seems like a good idea.
-        //
-        if(head.depth == MAX_BVH_DEPTH || head.node->entry_count < MIN_BVH_ENTRIES_TO_SPLIT) continue;
+    u32 left_index  = node->first_index + 0;
+    u32 right_index = node->first_index + 1;
+    b8 left_alive   = refit_node(bvh, left_index);
+    b8 right_alive  = refit_node(bvh, right_index);
+
+    if(left_alive && right_alive) {
+        refit_interior_node(bvh, node);
+    } else if(left_alive) {
+        *node = bvh->nodes[left_index];
+    } else if(right_alive) {
+        *node = bvh->nodes[right_index];
+    }
 
-        s64 split_axis; // x = 0, y = 1, z = 2
-        real split_value;
-        real percentage_along_split_axis;
-        
-        //
-        // Calculate the splitting plane for this node.
-        //
-        {
-            vec3 size = head.node->max - head.node->min;
+    return left_alive || right_alive;
+}
 
-            if(size.x > size.y && size.x > size.z) {
-                split_axis = 0;
-            } else if(size.y > size.z) {
-                split_axis = 1;
-            } else {
-                split_axis = 2;
+static
+b8 rotate_node(BVH *bvh, u32 node_index) {
+    //
+    // https://www.cs.utah.edu/~thiago/papers/rotations.pdf
+    // Try swapping one child of this node with one of the grandchildren on the other side, if that reduces
+    // the surface area of the other child. The bounds of this node don't change by doing so. Since children
+    // are referenced by index, swapping two nodes moves their entire subtrees.
+    //
+    BVH_Node *node = &bvh->nodes[node_index];
+    if(node->is_leaf()) return false;
+
+    real best_area_reduction = 0.;
+    u32 best_child = BVH_INVALID_INDEX, best_grandchild = BVH_INVALID_INDEX, best_parent = BVH_INVALID_INDEX;
+
+    for(u32 c = 0; c < 2; ++c) {
+        u32 child_index = node->first_index + c;
+        u32 other_index = node->first_index + 1 - c;
+        BVH_Node *child = &bvh->nodes[child_index];
+        BVH_Node *other = &bvh->nodes[other_index];
+        if(other->is_leaf()) continue;
+
+        real other_area = other->surface_area();
+
+        for(u32 g = 0; g < 2; ++g) {
+            BVH_Node *remaining = &bvh->nodes[other->first_index + 1 - g];
+
+            vec3 new_min = child->min, new_max = child->max;
+            include_in_bounds(new_min, new_max, remaining->min, remaining->max);
+
+            real area_reduction = other_area - aabb_surface_area(new_min, new_max);
+            if(area_reduction > best_area_reduction) {
+                best_area_reduction = area_reduction;
+                best_child          = child_index;
+                best_grandchild     = other->first_index + g;
+                best_parent         = other_index;
             }
-            
-            percentage_along_split_axis = 0.5;
-            split_value = head.node->min.values[split_axis] + (head.node->max.values[split_axis] - head.node->min.values[split_axis]) * percentage_along_split_axis;
         }
-        
-        s64 first_right_child_index;
+    }
 
-        //
-        // Sort the entries included in this node so that the ones contained in the left
-        // and right children are each continuous in the entries array.
-        //
-        {
-            s64 left_idx = head.node->first_entry_index, right_idx = head.node->first_entry_index + head.node->entry_count - 1;
-            while(left_idx <= right_idx) {
-                BVH_Entry &entry = this->entries[left_idx];
-                if(entry.center.values[split_axis] > split_value) {
-                    // This entry is inside the right child, but is currently located in the
-                    // left child's section of the entries array. We need to swap it with
-                    // another entry to move it into the right subsection.
-                    auto tmp = this->entries[right_idx];
-                    this->entries[right_idx] = this->entries[left_idx];
-                    this->entries[left_idx] = tmp;
-                    --right_idx;
-                } else {
-                    // This entry is inside the left child, and it is already in the correct
-                    // spot in the entries array.
-                    ++left_idx;
-                }
-            }
+    if(best_child == BVH_INVALID_INDEX) return false;
 
-            first_right_child_index = left_idx;
-        }
+    BVH_Node tmp = bvh->nodes[best_child];
+    bvh->nodes[best_child] = bvh->nodes[best_grandchild];
+    bvh->nodes[best_grandchild] = tmp;
 
-        //
-        // Actually subdivide the node and add the children to the queue.
-        //
-        {
-            head.node->leaf = false;
-    
-            s64 left_count = first_right_child_index - head.node->first_entry_index;
-            s64 right_count = head.node->first_entry_index + head.node->entry_count - first_right_child_index;
-
-            if(left_count > 0) {
-                head.node->children[0] = (BVH_Node *) this->allocator->allocate(sizeof(BVH_Node));
-                head.node->children[0]->first_entry_index = head.node->first_entry_index;
-                head.node->children[0]->entry_count = left_count;
-                stack.add({ head.node->children[0], head.depth + 1 });
-            }
+    refit_interior_node(bvh, &bvh->nodes[best_parent]);
+    return true;
+}
 
-            if(right_count > 0) {
-                head.node->children[1] = (BVH_Node *) this->allocator->allocate(sizeof(BVH_Node));
-                head.node->children[1]->first_entry_index = first_right_child_index;
-                head.node->children[1]->entry_count = right_count;
-                stack.add({ head.node->children[1], head.depth + 1 });
-            }
+static
+u32 find_best_sibling(BVH *bvh, vec3 min, vec3 max, Resizable_Array<u32> *path) {
+    //
+    // Descend from the root, always into the child which gets enlarged the least by the new bounds, until
+    // turning the current node into a sibling is cheaper than going further down. The path stores all
+    // ancestors of the returned node, so that they can be refitted afterwards.
+    // https://box2d.org/files/ErinCatto_DynamicBVH_Full.pdf
+    //
+    u32 index = 0;
+
+    while(!bvh->nodes[index].is_leaf()) {
+        BVH_Node *node = &bvh->nodes[index];
+
+        vec3 combined_min = node->min, combined_max = node->max;
+        include_in_bounds(combined_min, combined_max, min, max);
+
+        real area          = node->surface_area();
+        real combined_area = aabb_surface_area(combined_min, combined_max);
+
+        // The cost of creating a new parent for this node and the new subtree.
+        real cost = 2. * combined_area;
+
+        // The minimum cost of pushing the new subtree further down, which enlarges this node.
+        real inheritance_cost = 2. * (combined_area - area);
+
+        real child_costs[2];
+        for(u32 c = 0; c < 2; ++c) {
+            BVH_Node *child = &bvh->nodes[node->first_index + c];
+            vec3 child_min = child->min, child_max = child->max;
+            include_in_bounds(child_min, child_max, min, max);
+
+            child_costs[c] = aabb_surface_area(child_min, child_max) + inheritance_cost;
+            if(!child->is_leaf()) child_costs[c] -= child->surface_area();
         }
-    }
-    
-    stack.clear();
-}
 
-BVH_Cast_Result BVH::cast_ray(vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {
-    vec3 inverse_ray_direction = 1. / ray_direction;
-    vec3 abs_inverse_ray_direction = vec3(fabs(inverse_ray_direction.x), fabs(inverse_ray_direction.y), fabs(inverse_ray_direction.z));
-    
-    BVH_Cast_Result result;
-    result.hit_something = false;
-    result.hit_distance  = MAX_F32;
+        if(cost < child_costs[0] && cost < child_costs[1]) break;
 
-    const s32 MAX_NODE_STACK_SIZE = 1 << MAX_BVH_DEPTH;
-    BVH_Node *stack[MAX_NODE_STACK_SIZE];
-    s32 stack_count = 0;
+        path->add(index);
+        index = node->first_index + (child_costs[0] <= child_costs[1] ? 0 : 1);
+    }
 
-#define add_to_stack(value) { assert(stack_count < MAX_NODE_STACK_SIZE); stack[stack_count++] = value; }
-#define pop_stack() stack[--stack_count]
+    return index;
+}
 
-    add_to_stack(&this->root);    
+/* The Morton (LBVH) builder sorts all references along a Z-order curve once, after which every node can
+   just be split at the first bit in which the Morton codes of its references differ, without having to look
+   at (or move) any references. */
 
-    while(stack_count) {
-        BVH_Node *node = pop_stack(); // @@Speed: Does the order matter here? Do we have a higher chance of finding a result quicker if we query this in another way?
+static inline
+u64 expand_morton_bits(u64 value) {
+    // Insert two zero bits in between each of the lower 21 bits.
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8)  & 0x100f00f00f00f00f;
+    value = (value | value << 4)  & 0x10c30c30c30c30c3;
+    value = (value | value << 2)  & 0x1249249249249249;
+    return value;
+}
 
-        b8 intersects_aabb;
-        
-        // Check if ray intersects this box's AABB at all. If not, we can ignore it.
-        {
-            // https://iquilezles.org/articles/intersectors/
-            vec3 box_origin = (node->max + node->min) * .5;
-            vec3 box_size   = (node->max - node->min);
-            vec3 transformed_ray_origin = inverse_ray_direction * (ray_origin - box_origin);
-            vec3 projected_box_size     = abs_inverse_ray_direction * box_size;
-            vec3 t1 = -transformed_ray_origin - projected_box_size;
-            vec3 t2 = -transformed_ray_origin + projected_box_size;
-            real tnear = max_ignore_nan(max_ignore_nan(t1.x, t1.y), t1.z);
-            real tfar  = min_ignore_nan(min_ignore_nan(t2.x, t2.y), t2.z);
-
-            if(tnear <= 0. && tfar >= 0.) {
-                // We are inside the box!
-                intersects_aabb = true;
-            } else if(tfar >= 0. && tnear <= tfar && tnear <= max_ray_distance) {
-                // The near intersection is inside our ray.
-                intersects_aabb = true;
-            } else {
-                intersects_aabb = false;
-            }
-        }
+static inline
+u64 calculate_morton_code(vec3 center, vec3 centroid_min, vec3 centroid_scale) {
+    const real max_coordinate = (real) ((1 << BVH_MORTON_BITS_PER_AXIS) - 1);
 
-        if(!intersects_aabb) {
-            continue;
-        }
-        
-        if(node->leaf) {
-            // Check all triangles contained in this node against the ray.
-            s64 one_plus_last_entry_index = node->first_entry_index + node->entry_count;
-            for(s64 i = node->first_entry_index; i < one_plus_last_entry_index; ++i) {
-                auto entry_result = cast_ray_against_entry(&this->entries[i], ray_origin, ray_direction, max_ray_distance);
-
-                if(entry_result.hit_something && entry_result.hit_distance < result.hit_distance) {
-                    result = entry_result;
-                    goto early_exit;
-                }
-            }
-        } else {
-            // Add all children of this node to the stack.
-            if(node->children[0]) add_to_stack(node->children[0]);
-            if(node->children[1]) add_to_stack(node->children[1]);
-        }
+    u64 coordinates[AXIS_COUNT];
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        real normalized = (center.values[axis] - centroid_min.values[axis]) * centroid_scale.values[axis];
+        coordinates[axis] = (u64) clamp(normalized, 0., max_coordinate);
+    }
+
+    return expand_morton_bits(coordinates[0]) << 2 | expand_morton_bits(coordinates[1]) << 1 | expand_morton_bits(coordinates[2]);
+}
+
+static
+void morton_code_job(BVH_Morton_Job *job) {
+    tmFunction(TM_BVH_COLOR);
+
+    for(s64 i = job->first; i < job->one_plus_last; ++i) {
+        job->source[i].code            = calculate_morton_code(get_reference_center(&job->bvh->references[i]), job->centroid_min, job->centroid_scale);
+        job->source[i].reference_index = (u32) i;
+    }
+}
+
+static
+void radix_histogram_job(BVH_Morton_Job *job) {
+    for(s64 i = 0; i < BVH_RADIX_BUCKETS; ++i) job->offsets[i] = 0;
+
+    for(s64 i = job->first; i < job->one_plus_last; ++i) {
+        ++job->offsets[(job->source[i].code >> job->shift) & (BVH_RADIX_BUCKETS - 1)];
+    }
+}
+
+static
+void radix_scatter_job(BVH_Morton_Job *job) {
+    for(s64 i = job->first; i < job->one_plus_last; ++i) {
+        s64 bucket = (job->source[i].code >> job->shift) & (BVH_RADIX_BUCKETS - 1);
+        job->destination[job->offsets[bucket]++] = job->source[i];
+    }
+}
+
+static
+void run_morton_jobs(Job_System *job_system, BVH_Morton_Job *jobs, s64 job_count, void (*procedure)(BVH_Morton_Job *)) {
+    if(job_system && job_count > 1) {
+        for(s64 i = 0; i < job_count; ++i) spawn_job(job_system, { (Job_Procedure) procedure, &jobs[i] });
+        wait_for_all_jobs(job_system);
+    } else {
+        for(s64 i = 0; i < job_count; ++i) procedure(&jobs[i]);
+    }
+}
+
+static
+void sort_references_by_morton_code(BVH *bvh, Job_System *job_system) {
+    tmFunction(TM_BVH_COLOR);
+
+    s64 entry_count = bvh->references.count;
+
+    vec3 centroid_min = vec3(MAX_F32, MAX_F32, MAX_F32);
+    vec3 centroid_max = vec3(MIN_F32, MIN_F32, MIN_F32);
+
+    for(BVH_Reference &reference : bvh->references) {
+        vec3 center = get_reference_center(&reference);
+        include_in_min_bounds(centroid_min, center);
+        include_in_max_bounds(centroid_max, center);
+    }
+
+    vec3 centroid_scale;
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        real extent = centroid_max.values[axis] - centroid_min.values[axis];
+        centroid_scale.values[axis] = extent > 0. ? (real) ((1 << BVH_MORTON_BITS_PER_AXIS) - 1) / extent : 0.;
+    }
+
+    //
+    // Split the work into chunks, each of which is handled by one job in each phase.
+    //
+    s64 job_count = job_system ? clamp(entry_count / BVH_MORTON_JOB_ENTRIES, 1, BVH_MORTON_MAX_JOBS) : 1;
+    s64 entries_per_job = (entry_count + job_count - 1) / job_count;
+    
+    BVH_Morton_Key *keys    = (BVH_Morton_Key *) bvh->allocator->allocate(entry_count * sizeof(BVH_Morton_Key));
+    BVH_Morton_Key *scratch = (BVH_Morton_Key *) bvh->allocator->allocate(entry_count * sizeof(BVH_Morton_Key));
+    BVH_Morton_Job *jobs    = (BVH_Morton_Job *) bvh->allocator->allocate(job_count * sizeof(BVH_Morton_Job));
+
+    for(s64 i = 0; i < job_count; ++i) {
+        jobs[i].bvh            = bvh;
+        jobs[i].first          = min(i * entries_per_job, entry_count);
+        jobs[i].one_plus_last  = min((i + 1) * entries_per_job, entry_count);
+        jobs[i].centroid_min   = centroid_min;
+        jobs[i].centroid_scale = centroid_scale;
+        jobs[i].source         = keys;
+    }
+
+    run_morton_jobs(job_system, jobs, job_count, morton_code_job);
+
+    //
+    // Least-significant-digit radix sort. Each pass is stable, since every job scatters its chunk in order
+    // and the chunks get consecutive output ranges for each bucket.
+    //
+    for(s64 shift = 0; shift < AXIS_COUNT * BVH_MORTON_BITS_PER_AXIS; shift += BVH_RADIX_BITS) {
+        for(s64 i = 0; i < job_count; ++i) {
+            jobs[i].source      = keys;
+            jobs[i].destination = scratch;
+            jobs[i].shift       = shift;
+        }
+
+        run_morton_jobs(job_system, jobs, job_count, radix_histogram_job);
+
+        // If all keys fall into the same bucket, this pass wouldn't change anything.
+        b8 single_bucket = false;
+        for(s64 bucket = 0; bucket < BVH_RADIX_BUCKETS; ++bucket) {
+            s64 bucket_count = 0;
+            for(s64 i = 0; i < job_count; ++i) bucket_count += jobs[i].offsets[bucket];
+            if(bucket_count == entry_count) single_bucket = true;
+        }
+
+        if(single_bucket) continue;
+
+        // Turn the per-chunk histograms into output offsets.
+        s64 offset = 0;
+        for(s64 bucket = 0; bucket < BVH_RADIX_BUCKETS; ++bucket) {
+            for(s64 i = 0; i < job_count; ++i) {
+                s64 count = jobs[i].offsets[bucket];
+                jobs[i].offsets[bucket] = offset;
+                offset += count;
+            }
+        }
+
+        run_morton_jobs(job_system, jobs, job_count, radix_scatter_job);
+
+        BVH_Morton_Key *tmp = keys;
+        keys    = scratch;
+        scratch = tmp;
+    }
+
+    //
+    // Move the references into their sorted order.
+    //
+    Resizable_Array<BVH_Reference> sorted_references;
+    sorted_references.allocator = bvh->allocator;
+    sorted_references.reserve(entry_count);
+
+    for(s64 i = 0; i < entry_count; ++i) {
+        BVH_Reference reference = bvh->references[keys[i].reference_index];
+        reference.morton_code   = keys[i].code;
+        sorted_references.add(reference);
+    }
+
+    bvh->references.clear();
+    bvh->references = sorted_references;
+
+    bvh->allocator->deallocate(jobs);
+    bvh->allocator->deallocate(scratch);
+    bvh->allocator->deallocate(keys);
+}
+
+static
+void find_morton_split(BVH *bvh, BVH_Node *node, BVH_Split *split) {
+    s64 first = node->first_index;
+    s64 last  = node->first_index + node->entry_count - 1;
+
+    u64 first_code = bvh->references[first].morton_code;
+    u64 last_code  = bvh->references[last].morton_code;
+
+    split->valid = true;
+    
+    if(first_code == last_code) {
+        // All references share the same code, so there is no spatial information left. Just split in half.
+        split->first_right_reference = first + node->entry_count / 2;
+        return;
+    }
+
+    // Find the highest bit in which the first and the last code differ. All codes in between share the
+    // bits above, so the node gets split at the first reference which has this bit set.
+    u64 difference = first_code ^ last_code;
+    s64 bit = 63;
+    while(!(difference & (1ull << bit))) --bit;
+
+    u64 bit_mask = 1ull << bit;
+    s64 low = first + 1, high = last; // The first reference with the bit set is somewhere in (first, last].
+
+    while(low < high) {
+        s64 middle = (low + high) / 2;
+        if(bvh->references[middle].morton_code & bit_mask) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    split->first_right_reference = low;
+}
+
+static
+s64 optimize_subtree_with_rotations(BVH *bvh, u32 node_index, s64 level) {
+    //
+    // The Morton builder only looks at the reference centers, which can result in rather loose nodes. Running
+    // tree rotations bottom-up over the entire tree recovers a good part of the SAH quality for very little
+    // cost. Returns (an upper bound of) the height of this subtree.
+    //
+    BVH_Node *node = &bvh->nodes[node_index];
+    if(node->is_leaf()) return 1;
+
+    s64 left_height  = optimize_subtree_with_rotations(bvh, node->first_index + 0, level + 1);
+    s64 right_height = optimize_subtree_with_rotations(bvh, node->first_index + 1, level + 1);
+    s64 height = max(left_height, right_height) + 1;
+
+    // A rotation makes this subtree at most one level deeper, which must not exceed the maximum depth.
+    if(level + height <= MAX_BVH_DEPTH && rotate_node(bvh, node_index)) ++height;
+
+    return height;
+}
+
+static
+s64 calculate_depth(BVH *bvh, u32 node_index) {
+    BVH_Node *node = &bvh->nodes[node_index];
+    if(node->is_leaf()) return 1;
+
+    s64 left  = calculate_depth(bvh, node->first_index + 0);
+    s64 right = calculate_depth(bvh, node->first_index + 1);
+    return max(left, right) + 1;
+}
+
+static
+s64 subdivide_nodes(BVH *bvh, BVH_Split_Method split_method, BVH_Node *nodes, s64 node_count, u32 root_index, u32 root_depth, Resizable_Array<BVH_Subtree_Job> *subtree_jobs) {
+    //
+    // Subdivides the node at root_index in the given node storage, appending all new nodes to it. The storage
+    // must have room for the entire subtree (2n - 1 nodes for n references), so that we never need to allocate
+    // in here, since this also runs on the worker threads. Returns the new node count.
+    // If subtree_jobs is not null, then smaller subtrees get deferred into jobs instead of being subdivided.
+    // Spatial splits change the number of references, so they have their own builder below.
+    //
+    assert(split_method != BVH_SPLIT_Spatial_SAH);
+
+    BVH_Node_Stack stack[BVH_BINARY_STACK_SIZE];
+    s64 stack_count = 0;
+    stack[stack_count++] = { root_index, root_depth };
+
+    while(stack_count) {
+        BVH_Node_Stack head = stack[--stack_count];
+        BVH_Node *node = &nodes[head.node_index];
+        
+        //
+        // Calculate the bounds for this node.
+        //
+        {
+            node->min = vec3(MAX_F32, MAX_F32, MAX_F32);
+            node->max = vec3(MIN_F32, MIN_F32, MIN_F32);
+
+            s64 one_plus_last = node->first_index + node->entry_count;
+            for(s64 i = node->first_index; i < one_plus_last; ++i) {
+                BVH_Reference &reference = bvh->references[i];
+                include_in_bounds(node->min, node->max, reference.min, reference.max);
+            }
+        }
+
+        //
+        // Only subdivide this node if we haven't reached the max node depth yet and this node actually contains
+        // enough references that splitting seems like a good idea.
+        //
+        if(head.depth >= MAX_BVH_DEPTH || node->entry_count < MIN_BVH_ENTRIES_TO_SPLIT) continue;
+
+        //
+        // If this subtree is small enough, hand it off to a job instead of subdividing it here.
+        //
+        if(subtree_jobs && head.node_index != root_index && node->entry_count <= BVH_MAX_ENTRIES_PER_JOB) {
+            subtree_jobs->add({ bvh, head.node_index, head.depth, null, 0 });
+            continue;
+        }
+
+        BVH_Split split;
+        
+        //
+        // Calculate the splitting plane for this node.
+        //
+        switch(split_method) {
+        case BVH_SPLIT_Midpoint:   find_midpoint_split(node, &split); break;
+        case BVH_SPLIT_Binned_SAH: find_binned_sah_split(&bvh->references[node->first_index], node->entry_count, node, &split); break;
+        case BVH_SPLIT_Morton:     find_morton_split(bvh, node, &split); break;
+        case BVH_SPLIT_Spatial_SAH: break;
+        }
+
+        if(!split.valid) continue;
+
+        //
+        // Stop if splitting doesn't pay off, meaning the expected cost of traversing the children is higher
+        // than just intersecting all references in this node. The midpoint split doesn't have a cost, so that one
+        // just keeps going until the nodes become too small.
+        //
+        if(split_method == BVH_SPLIT_Binned_SAH && node->entry_count <= MAX_BVH_ENTRIES_IN_LEAF) {
+            real leaf_cost = BVH_SAH_INTERSECTION_COST * node->entry_count;
+            if(split.cost >= leaf_cost) continue;
+        }
+        
+        s64 first_right_child_index;
+
+        //
+        // Sort the references included in this node so that the ones contained in the left
+        // and right children are each continuous in the references array. The Morton builder has
+        // already sorted all references up front.
+        //
+        if(split_method == BVH_SPLIT_Morton) {
+            first_right_child_index = split.first_right_reference;
+        } else {
+            s64 left_idx = node->first_index, right_idx = node->first_index + node->entry_count - 1;
+            while(left_idx <= right_idx) {
+                BVH_Reference &reference = bvh->references[left_idx];
+                if(reference_belongs_in_right_child(split_method, &split, &reference)) {
+                    // This reference is inside the right child, but is currently located in the
+                    // left child's section of the references array. We need to swap it with
+                    // another reference to move it into the right subsection.
+                    auto tmp = bvh->references[right_idx];
+                    bvh->references[right_idx] = bvh->references[left_idx];
+                    bvh->references[left_idx] = tmp;
+                    --right_idx;
+                } else {
+                    // This reference is inside the left child, and it is already in the correct
+                    // spot in the references array.
+                    ++left_idx;
+                }
+            }
+
+            first_right_child_index = left_idx;
+        }
+
+        //
+        // Actually subdivide the node and add the children to the queue.
+        //
+        {
+            u32 left_count  = (u32) (first_right_child_index - node->first_index);
+            u32 right_count = (u32) (node->first_index + node->entry_count - first_right_child_index);
+
+            // If all references ended up on one side, the child would just be a copy of this node, so we might as
+            // well stop here.
+            if(left_count == 0 || right_count == 0) continue;
+            
+            u32 left_index = (u32) node_count;
+            
+            BVH_Node *left  = &nodes[node_count++];
+            left->first_index = node->first_index;
+            left->entry_count = left_count;
+
+            BVH_Node *right = &nodes[node_count++];
+            right->first_index = (u32) first_right_child_index;
+            right->entry_count = right_count;
+
+            node->first_index = left_index;
+            node->entry_count = 0;
+            
+            // Push the right child first, so that the left one gets popped next. This keeps the subtree of the
+            // left child close to it in the node array, which helps traversal (but isn't relied upon).
+            assert(stack_count + 2 <= ARRAY_COUNT(stack));
+            stack[stack_count++] = { left_index + 1, head.depth + 1 };
+            stack[stack_count++] = { left_index + 0, head.depth + 1 };
+        }
+    }
+    
+
+    return node_count;
+}
+
+static
+void subtree_job(BVH_Subtree_Job *job) {
+    tmFunction(TM_BVH_COLOR);
+
+    job->nodes[0]   = job->bvh->nodes[job->node_index];
+    job->node_count = subdivide_nodes(job->bvh, job->bvh->split_method, job->nodes, 1, 0, job->depth, null);
+}
+
+/* The spatial split builder (SBVH) evaluates the usual binned object splits, but additionally considers
+   splitting the node's bounds into bins and clipping the references at the bin boundaries. A triangle which
+   straddles the chosen plane then gets referenced by both children, with each reference only covering its
+   half of the triangle. This keeps huge triangles (like the virtually extended delimiter planes) from
+   bloating every node they end up in.
+   https://www.nvidia.com/docs/IO/77714/sbvh.pdf */
+
+struct BVH_Spatial_Builder {
+    BVH *bvh;
+    real root_area;
+    s64 remaining_duplicates; // Spatial splits stop being considered once this budget has been used up.
+};
+
+static
+void split_reference(BVH *bvh, BVH_Reference *reference, s64 axis, real position, BVH_Reference *left, BVH_Reference *right) {
+    //
+    // Clip the triangle at the plane and gather the bounds of both halves. These then get intersected with
+    // the bounds of the reference, since the triangle might have already been clipped by a previous split.
+    // If the triangle doesn't actually reach into one side, the bounds of that side end up invalid.
+    //
+    left->min  = vec3(MAX_F32, MAX_F32, MAX_F32);
+    left->max  = vec3(MIN_F32, MIN_F32, MIN_F32);
+    right->min = vec3(MAX_F32, MAX_F32, MAX_F32);
+    right->max = vec3(MIN_F32, MIN_F32, MIN_F32);
+    left->entry_index = right->entry_index = reference->entry_index;
+    left->morton_code = right->morton_code = 0;
+
+    Triangle &triangle = bvh->entries[reference->entry_index].triangle;
+    vec3 vertices[3] = { triangle.p0, triangle.p1, triangle.p2 };
+
+    for(s64 i = 0; i < 3; ++i) {
+        vec3 from = vertices[i], to = vertices[(i + 1) % 3];
+        real from_value = from.values[axis], to_value = to.values[axis];
+
+        if(from_value <= position) include_in_bounds(left->min, left->max, from, from);
+        if(from_value >= position) include_in_bounds(right->min, right->max, from, from);
+
+        if((from_value < position && to_value > position) || (from_value > position && to_value < position)) {
+            vec3 point = from + (to - from) * ((position - from_value) / (to_value - from_value));
+            point.values[axis] = position;
+            include_in_bounds(left->min, left->max, point, point);
+            include_in_bounds(right->min, right->max, point, point);
+        }
+    }
+
+    for(s64 i = 0; i < AXIS_COUNT; ++i) {
+        left->min.values[i]  = max(left->min.values[i],  reference->min.values[i]);
+        left->max.values[i]  = min(left->max.values[i],  reference->max.values[i]);
+        right->min.values[i] = max(right->min.values[i], reference->min.values[i]);
+        right->max.values[i] = min(right->max.values[i], reference->max.values[i]);
+    }
+}
+
+static
+void find_spatial_split(BVH *bvh, BVH_Reference *references, s64 reference_count, BVH_Node *node, BVH_Split *split) {
+    split->valid   = false;
+    split->spatial = true;
+    split->cost    = MAX_F32;
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        real node_min = node->min.values[axis];
+        real extent   = node->max.values[axis] - node_min;
+        if(extent <= CORE_SMALL_EPSILON) continue;
+
+        real bin_scale = BVH_SAH_BIN_COUNT / extent;
+        real bin_size  = extent / BVH_SAH_BIN_COUNT;
+
+        BVH_Spatial_Bin bins[BVH_SAH_BIN_COUNT];
+        for(s64 i = 0; i < BVH_SAH_BIN_COUNT; ++i) {
+            bins[i].min         = vec3(MAX_F32, MAX_F32, MAX_F32);
+            bins[i].max         = vec3(MIN_F32, MIN_F32, MIN_F32);
+            bins[i].enter_count = 0;
+            bins[i].exit_count  = 0;
+        }
+
+        //
+        // Chop every reference into the bins it overlaps, so that each bin only grows by the part of the
+        // triangle which actually lies inside of it.
+        //
+        for(s64 i = 0; i < reference_count; ++i) {
+            BVH_Reference remaining = references[i];
+            s64 first_bin = get_sah_bin_index(remaining.min.values[axis], node_min, bin_scale);
+            s64 last_bin  = get_sah_bin_index(remaining.max.values[axis], node_min, bin_scale);
+
+            for(s64 bin = first_bin; bin < last_bin; ++bin) {
+                BVH_Reference left, right;
+                split_reference(bvh, &remaining, axis, node_min + (bin + 1) * bin_size, &left, &right);
+                if(bounds_are_valid(left.min, left.max)) include_in_bounds(bins[bin].min, bins[bin].max, left.min, left.max);
+                remaining = right;
+            }
+
+            if(bounds_are_valid(remaining.min, remaining.max)) include_in_bounds(bins[last_bin].min, bins[last_bin].max, remaining.min, remaining.max);
+
+            ++bins[first_bin].enter_count;
+            ++bins[last_bin].exit_count;
+        }
+
+        //
+        // Same sweep as for the object splits, except that references which overlap the plane are counted on
+        // both sides.
+        //
+        vec3 left_min[BVH_SAH_BIN_COUNT - 1], left_max[BVH_SAH_BIN_COUNT - 1];
+        s64 left_count[BVH_SAH_BIN_COUNT - 1];
+
+        {
+            vec3 min = vec3(MAX_F32, MAX_F32, MAX_F32), max = vec3(MIN_F32, MIN_F32, MIN_F32);
+            s64 count = 0;
+
+            for(s64 i = 0; i < BVH_SAH_BIN_COUNT - 1; ++i) {
+                if(bounds_are_valid(bins[i].min, bins[i].max)) include_in_bounds(min, max, bins[i].min, bins[i].max);
+                count += bins[i].enter_count;
+
+                left_min[i]   = min;
+                left_max[i]   = max;
+                left_count[i] = count;
+            }
+        }
+
+        {
+            vec3 min = vec3(MAX_F32, MAX_F32, MAX_F32), max = vec3(MIN_F32, MIN_F32, MIN_F32);
+            s64 count = 0;
+
+            for(s64 i = BVH_SAH_BIN_COUNT - 1; i > 0; --i) {
+                if(bounds_are_valid(bins[i].min, bins[i].max)) include_in_bounds(min, max, bins[i].min, bins[i].max);
+                count += bins[i].exit_count;
+
+                if(!count || !left_count[i - 1]) continue; // Don't allow empty children.
+                if(!bounds_are_valid(min, max) || !bounds_are_valid(left_min[i - 1], left_max[i - 1])) continue;
+
+                real cost = aabb_surface_area(left_min[i - 1], left_max[i - 1]) * left_count[i - 1] + aabb_surface_area(min, max) * count;
+                if(cost < split->cost) {
+                    split->valid           = true;
+                    split->cost            = cost;
+                    split->axis            = axis;
+                    split->centroid_min    = node_min;
+                    split->bin_scale       = bin_scale;
+                    split->first_right_bin = i;
+                    split->position        = node_min + i * bin_size;
+                    split->left_min        = left_min[i - 1];
+                    split->left_max        = left_max[i - 1];
+                    split->right_min       = min;
+                    split->right_max       = max;
+                }
+            }
+        }
+    }
+
+    if(split->valid) {
+        real node_area = node->surface_area();
+        split->cost = BVH_SAH_TRAVERSAL_COST + BVH_SAH_INTERSECTION_COST * (node_area > 0. ? split->cost / node_area : split->cost);
+    }
+}
+
+static
+void partition_references(BVH *bvh, Resizable_Array<BVH_Reference> &references, BVH_Split *split, Resizable_Array<BVH_Reference> &left, Resizable_Array<BVH_Reference> &right) {
+    for(BVH_Reference &reference : references) {
+        if(!split->spatial) {
+            if(reference_belongs_in_right_child(BVH_SPLIT_Spatial_SAH, split, &reference)) {
+                right.add(reference);
+            } else {
+                left.add(reference);
+            }
+
+            continue;
+        }
+
+        // This must exactly match the binning in find_spatial_split.
+        s64 first_bin = get_sah_bin_index(reference.min.values[split->axis], split->centroid_min, split->bin_scale);
+        s64 last_bin  = get_sah_bin_index(reference.max.values[split->axis], split->centroid_min, split->bin_scale);
+
+        if(last_bin < split->first_right_bin) {
+            left.add(reference);
+        } else if(first_bin >= split->first_right_bin) {
+            right.add(reference);
+        } else {
+            BVH_Reference left_half, right_half;
+            split_reference(bvh, &reference, split->axis, split->position, &left_half, &right_half);
+
+            b8 left_valid  = bounds_are_valid(left_half.min, left_half.max);
+            b8 right_valid = bounds_are_valid(right_half.min, right_half.max);
+
+            if(left_valid)  left.add(left_half);
+            if(right_valid) right.add(right_half);
+            if(!left_valid && !right_valid) left.add(reference); // Numerical trouble, just keep the reference intact.
+        }
+    }
+}
+
+static
+void subdivide_spatial_node(BVH_Spatial_Builder *builder, u32 node_index, Resizable_Array<BVH_Reference> &references, s64 depth) {
+    //
+    // Unlike subdivide_nodes, this cannot partition the references in place, since a spatial split may
+    // create new references. Instead, every node gets its own array of references, and the leaves move their
+    // references into the BVH's array. The children of a node are still allocated next to each other.
+    // This consumes the given references array.
+    //
+    BVH *bvh = builder->bvh;
+    BVH_Node *node = &bvh->nodes[node_index];
+    
+    node->min = vec3(MAX_F32, MAX_F32, MAX_F32);
+    node->max = vec3(MIN_F32, MIN_F32, MIN_F32);
+    for(BVH_Reference &reference : references) include_in_bounds(node->min, node->max, reference.min, reference.max);
+
+    BVH_Split split;
+    split.valid = false;
+
+    if(depth < MAX_BVH_DEPTH && references.count >= MIN_BVH_ENTRIES_TO_SPLIT) {
+        find_binned_sah_split(references.data, references.count, node, &split);
+
+        //
+        // Spatial splits are only worth looking at if the children of the object split overlap a lot,
+        // which is exactly what happens around large triangles.
+        //
+        b8 try_spatial_split = builder->remaining_duplicates > 0;
+
+        if(try_spatial_split && split.valid) {
+            vec3 overlap_min, overlap_max;
+            for(s64 i = 0; i < AXIS_COUNT; ++i) {
+                overlap_min.values[i] = max(split.left_min.values[i], split.right_min.values[i]);
+                overlap_max.values[i] = min(split.left_max.values[i], split.right_max.values[i]);
+            }
+
+            try_spatial_split = bounds_are_valid(overlap_min, overlap_max) && aabb_surface_area(overlap_min, overlap_max) > BVH_SPATIAL_SPLIT_ALPHA * builder->root_area;
+        }
+
+        if(try_spatial_split) {
+            BVH_Split spatial_split;
+            find_spatial_split(bvh, references.data, references.count, node, &spatial_split);
+            if(spatial_split.valid && (!split.valid || spatial_split.cost < split.cost)) split = spatial_split;
+        }
+
+        if(split.valid && references.count <= MAX_BVH_ENTRIES_IN_LEAF) {
+            real leaf_cost = BVH_SAH_INTERSECTION_COST * references.count;
+            if(split.cost >= leaf_cost) split.valid = false;
+        }
+    }
+
+    Resizable_Array<BVH_Reference> left, right;
+    left.allocator  = bvh->allocator;
+    right.allocator = bvh->allocator;
+
+    if(split.valid) partition_references(bvh, references, &split, left, right);
+
+    if(!split.valid || !left.count || !right.count) {
+        node->first_index = (u32) bvh->references.count;
+        node->entry_count = (u32) references.count;
+        for(BVH_Reference &reference : references) bvh->references.add(reference);
+
+        references.clear();
+        left.clear();
+        right.clear();
+        return;
+    }
+
+    builder->remaining_duplicates -= left.count + right.count - references.count;
+    references.clear();
+    
+    u32 left_index = (u32) bvh->nodes.count;
+    bvh->nodes.push();
+    bvh->nodes.push();
+
+    node = &bvh->nodes[node_index]; // The node array might have grown.
+    node->first_index = left_index;
+    node->entry_count = 0;
+
+    subdivide_spatial_node(builder, left_index + 0, left,  depth + 1);
+    subdivide_spatial_node(builder, left_index + 1, right, depth + 1);
+}
+
+static
+void subdivide_with_spatial_splits(BVH *bvh) {
+    tmFunction(TM_BVH_COLOR);
+
+    //
+    // The spatial split builder always runs on this thread, since the subtrees don't work on disjoint ranges
+    // of a pre-sized references array.
+    //
+    Resizable_Array<BVH_Reference> references = bvh->references;
+
+    bvh->references = Resizable_Array<BVH_Reference>();
+    bvh->references.allocator = bvh->allocator;
+    bvh->references.reserve((s64) (references.count * (1. + BVH_SPATIAL_SPLIT_BUDGET)));
+
+    vec3 root_min = vec3(MAX_F32, MAX_F32, MAX_F32), root_max = vec3(MIN_F32, MIN_F32, MIN_F32);
+    for(BVH_Reference &reference : references) include_in_bounds(root_min, root_max, reference.min, reference.max);
+
+    BVH_Spatial_Builder builder;
+    builder.bvh                  = bvh;
+    builder.root_area            = aabb_surface_area(root_min, root_max);
+    builder.remaining_duplicates = (s64) (references.count * BVH_SPATIAL_SPLIT_BUDGET);
+
+    bvh->nodes.push();
+    subdivide_spatial_node(&builder, 0, references, 1);
+
+    assert(bvh->references.count < MAX_U32);
+}
+
+void BVH::subdivide(Job_System *job_system) {
+    tmFunction(TM_BVH_COLOR);
+
+    this->detach_from_blob();
+
+    assert(this->entries.count < MAX_U32);
+
+    this->nodes.clear();
+    this->references.clear();
+    this->triangle_blocks.clear();
+
+    // Get rid of all entries which have been removed since the last build.
+    s64 live_entry_count = 0;
+    for(s64 i = 0; i < this->entries.count; ++i) {
+        if(!this->entries[i].removed) this->entries[live_entry_count++] = this->entries[i];
+    }
+
+    this->entries.count = live_entry_count;
+    this->depth         = 0;
+    
+    if(!this->entries.count) {
+        this->wide_nodes.clear();
+        return;
+    }
+
+    // Every entry starts out with a single reference covering the entire triangle.
+    this->references.reserve(this->entries.count);
+    for(s64 i = 0; i < this->entries.count; ++i) this->references.add(make_reference(this, (u32) i));
+
+    // A binary tree in which every leaf holds at least one reference cannot have more than 2n - 1 nodes, so
+    // reserve that much up front to avoid re-allocating (and copying) the node array while building.
+    this->nodes.reserve(this->references.count * 2 - 1);
+
+    if(this->split_method == BVH_SPLIT_Morton) sort_references_by_morton_code(this, job_system);
+    
+    if(this->split_method == BVH_SPLIT_Spatial_SAH) {
+        subdivide_with_spatial_splits(this);
+    } else if(job_system && this->references.count > BVH_MAX_ENTRIES_PER_JOB) {
+        BVH_Node *root    = this->nodes.push();
+        root->first_index = 0;
+        root->entry_count = (u32) this->references.count;
+
+        //
+        // Build the top levels of the tree on this thread, until the nodes are small enough to be worth a
+        // job. The subtrees work on disjoint ranges of the references array, so they can be built
+        // independently.
+        //
+        Resizable_Array<BVH_Subtree_Job> subtree_jobs;
+        subtree_jobs.allocator = this->allocator;
+
+        this->nodes.count = subdivide_nodes(this, this->split_method, this->nodes.data, this->nodes.count, 0, 1, &subtree_jobs);
+
+        // The allocator isn't thread-safe, so set up the per-job node storage on this thread.
+        for(BVH_Subtree_Job &job : subtree_jobs) {
+            job.nodes = (BVH_Node *) this->allocator->allocate((this->nodes[job.node_index].entry_count * 2 - 1) * sizeof(BVH_Node));
+        }
+
+        for(BVH_Subtree_Job &job : subtree_jobs) {
+            spawn_job(job_system, { (Job_Procedure) subtree_job, &job });
+        }
+
+        wait_for_all_jobs(job_system);
+
+        //
+        // Stitch the subtrees into the node array. The subtree's root replaces the node it was spawned for,
+        // all other nodes get appended. Since children are appended in pairs, siblings stay next to each other.
+        //
+        for(BVH_Subtree_Job &job : subtree_jobs) {
+            u32 offset = (u32) (this->nodes.count - 1); // Node i (for i > 0) of the subtree ends up at offset + i.
+
+            for(s64 i = 0; i < job.node_count; ++i) {
+                BVH_Node node = job.nodes[i];
+                if(!node.is_leaf()) node.first_index += offset;
+
+                if(i == 0) {
+                    this->nodes[job.node_index] = node;
+                } else {
+                    this->nodes.add(node);
+                }
+            }
+
+            this->allocator->deallocate(job.nodes);
+        }
+
+        subtree_jobs.clear();
+    } else {
+        BVH_Node *root    = this->nodes.push();
+        root->first_index = 0;
+        root->entry_count = (u32) this->references.count;
+
+        this->nodes.count = subdivide_nodes(this, this->split_method, this->nodes.data, this->nodes.count, 0, 1, null);
+    }
+
+    if(this->split_method == BVH_SPLIT_Morton) optimize_subtree_with_rotations(this, 0, 1);
+
+    this->depth = calculate_depth(this, 0);
+    this->build_triangle_blocks();
+    
+#if USE_WIDE_BVH
+    this->collapse();
+#endif
+}
+
+void BVH::build_triangle_blocks() {
+    tmFunction(TM_BVH_COLOR);
+
+    this->detach_from_blob();
+
+    //
+    // This must happen after the references have been sorted into the leaves, since the blocks mirror the
+    // order of the references array.
+    //
+    this->triangle_blocks.clear();
+    this->update_triangle_blocks(0, this->references.count);
+}
+
+void BVH::update_triangle_blocks(s64 first_reference, s64 one_plus_last_reference) {
+    this->detach_from_blob();
+
+    s64 block_count = (this->references.count + BVH_TRIANGLE_BLOCK_WIDTH - 1) / BVH_TRIANGLE_BLOCK_WIDTH;
+    this->triangle_blocks.reserve(block_count);
+
+    while(this->triangle_blocks.count < block_count) {
+        // Pad new blocks with degenerate triangles, which never get hit.
+        BVH_Triangle_Block *block = this->triangle_blocks.push();
+        *block = BVH_Triangle_Block();
+    }
+
+    for(s64 i = first_reference; i < one_plus_last_reference; ++i) {
+        BVH_Entry *entry = &this->entries[this->references[i].entry_index];
+        BVH_Triangle_Block *block = &this->triangle_blocks[i / BVH_TRIANGLE_BLOCK_WIDTH];
+        s64 lane = i % BVH_TRIANGLE_BLOCK_WIDTH;
+
+        // Removed entries become degenerate as well, so that the leaves can just keep them around.
+        vec3 v0 = vec3(0, 0, 0), e1 = vec3(0, 0, 0), e2 = vec3(0, 0, 0);
+
+        if(!entry->removed) {
+            v0 = entry->triangle.p0;
+            e1 = entry->triangle.p1 - entry->triangle.p0;
+            e2 = entry->triangle.p2 - entry->triangle.p0;
+        }
+
+        for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+            block->v0[axis][lane] = v0.values[axis];
+            block->e1[axis][lane] = e1.values[axis];
+            block->e2[axis][lane] = e2.values[axis];
+        }
+    }
+}
+
+void BVH::collapse() {
+    this->detach_from_blob();
+
+    this->wide_nodes.clear();
+    if(!this->nodes.count) return;
+
+    // Every wide node replaces at least one interior binary node (or the root leaf), so this is an upper
+    // bound and we never need to grow the array while building.
+    this->wide_nodes.reserve(this->nodes.count / 2 + 1);
+    this->wide_nodes.push();
+    
+    Resizable_Array<BVH_Collapse_Stack> stack;
+    stack.allocator = this->allocator;
+    stack.add({ 0, 0 });
+
+    while(stack.count) {
+        BVH_Collapse_Stack head = stack.pop();
+        BVH_Node *binary = &this->nodes[head.binary_index];
+
+        u32 children[BVH_WIDTH];
+        s64 child_count = 0;
+
+        //
+        // Gather the children of this wide node. We keep opening up the interior child with the largest
+        // surface area (since that is the one most likely to be hit by a ray), until we either have enough
+        // children or only leaves are left.
+        //
+        if(binary->is_leaf()) {
+            // This can only happen for the root, in which case the wide root has just the one leaf child.
+            children[child_count++] = head.binary_index;
+        } else {
+            children[child_count++] = binary->first_index + 0;
+            children[child_count++] = binary->first_index + 1;
+
+            while(child_count < BVH_WIDTH) {
+                s64 best_child = -1;
+                real best_area = -1;
+
+                for(s64 i = 0; i < child_count; ++i) {
+                    BVH_Node *child = &this->nodes[children[i]];
+                    if(child->is_leaf()) continue;
+
+                    real area = child->surface_area();
+                    if(area > best_area) {
+                        best_child = i;
+                        best_area  = area;
+                    }
+                }
+
+                if(best_child == -1) break;
+
+                u32 opened = children[best_child];
+                children[best_child]    = this->nodes[opened].first_index + 0;
+                children[child_count++] = this->nodes[opened].first_index + 1;
+            }
+        }
+
+        //
+        // Fill in the child slots of the wide node.
+        //
+        for(s64 i = 0; i < BVH_WIDTH; ++i) {
+            BVH_Wide_Node *wide = &this->wide_nodes[head.wide_index];
+            
+            if(i < child_count) {
+                BVH_Node *child = &this->nodes[children[i]];
+
+                for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+                    wide->bounds[axis][i]              = round_down_to_f32(child->min.values[axis]);
+                    wide->bounds[axis + AXIS_COUNT][i] = round_up_to_f32(child->max.values[axis]);
+                }
+
+                if(child->is_leaf()) {
+                    wide->first_index[i] = child->first_index;
+                    wide->entry_count[i] = child->entry_count;
+                } else {
+                    u32 wide_index = (u32) this->wide_nodes.count;
+                    this->wide_nodes.push();
+                    stack.add({ children[i], wide_index });
+                    
+                    wide = &this->wide_nodes[head.wide_index]; // The wide node array might have grown.
+                    wide->first_index[i] = wide_index;
+                    wide->entry_count[i] = 0;
+                }
+            } else {
+                for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+                    wide->bounds[axis][i]              = MAX_F32;
+                    wide->bounds[axis + AXIS_COUNT][i] = MIN_F32;
+                }
+
+                wide->first_index[i] = BVH_INVALID_INDEX;
+                wide->entry_count[i] = 0;
+            }
+        }
+    }
+
+    stack.clear();
+}
+
+void BVH::refit() {
+    tmFunction(TM_BVH_COLOR);
+
+    this->detach_from_blob();
+
+    for(BVH_Entry &entry : this->entries) {
+        entry.center = entry.triangle.center();
+    }
+
+    // Any clipping done by spatial splits is lost here, so the references fall back to the bounds of their
+    // entire triangle. That is still correct, just not as tight until the next full subdivide.
+    for(BVH_Reference &reference : this->references) {
+        reference = make_reference(this, reference.entry_index);
+    }
+
+    this->update_triangle_blocks(0, this->references.count);
+
+    if(this->nodes.count && !refit_node(this, 0)) this->nodes.clear();
+    this->depth = this->nodes.count ? calculate_depth(this, 0) : 0; // Pruning might have made the tree shallower.
+
+#if USE_WIDE_BVH
+    this->collapse();
+#endif
+}
+
+static
+u32 find_overflowing_subtree(BVH *bvh, u32 *level) {
+    //
+    // Finds the smallest subtree which contains every node below MAX_BVH_DEPTH, by descending from the root
+    // as long as only one child is too deep. Only the rotations along the insertion path can make the tree
+    // deeper, so this is usually a subtree close to the inserted one.
+    //
+    u32 node_index = 0;
+    *level = 1;
+
+    while(true) {
+        BVH_Node *node = &bvh->nodes[node_index];
+        if(node->is_leaf()) break;
+
+        b8 left_overflows  = *level + calculate_depth(bvh, node->first_index + 0) > MAX_BVH_DEPTH;
+        b8 right_overflows = *level + calculate_depth(bvh, node->first_index + 1) > MAX_BVH_DEPTH;
+        if(left_overflows == right_overflows) break;
+
+        node_index = node->first_index + (left_overflows ? 0 : 1);
+        *level += 1;
+    }
+
+    return node_index;
+}
+
+static
+void rebuild_subtree(BVH *bvh, u32 root_index, u32 root_level) {
+    tmFunction(TM_BVH_COLOR);
+
+    //
+    // The leaves of the subtree don't necessarily have one continuous slice of references anymore after
+    // insertions and rotations, so their references get copied to the end of the array, where the subtree is
+    // subdivided again. The old references and nodes stay unreferenced until the next full subdivide, the same
+    // way removed entries do.
+    //
+    u32 first_reference = (u32) bvh->references.count;
+
+    Resizable_Array<u32> stack;
+    stack.allocator = bvh->allocator;
+    stack.add(root_index);
+
+    while(stack.count) {
+        BVH_Node *node = &bvh->nodes[stack.pop()];
+
+        if(node->is_leaf()) {
+            for(u32 i = node->first_index; i < node->first_index + node->entry_count; ++i) {
+                BVH_Reference reference = bvh->references[i];
+                bvh->references.add(reference);
+            }
+        } else {
+            stack.add(node->first_index + 0);
+            stack.add(node->first_index + 1);
+        }
+    }
+
+    stack.clear();
+
+    u32 reference_count = (u32) (bvh->references.count - first_reference);
+
+    BVH_Node *subtree = (BVH_Node *) bvh->allocator->allocate((reference_count * 2 - 1) * sizeof(BVH_Node));
+    subtree[0].first_index = first_reference;
+    subtree[0].entry_count = reference_count;
+
+    // Same fallbacks as in insert(). subdivide_nodes never goes past MAX_BVH_DEPTH when given the actual
+    // level of the subtree's root.
+    BVH_Split_Method split_method = bvh->split_method == BVH_SPLIT_Morton || bvh->split_method == BVH_SPLIT_Spatial_SAH ? BVH_SPLIT_Binned_SAH : bvh->split_method;
+    s64 subtree_node_count = subdivide_nodes(bvh, split_method, subtree, 1, 0, root_level, null);
+
+    bvh->update_triangle_blocks(first_reference, bvh->references.count);
+
+    //
+    // The root of the subtree keeps its slot, so that the link from its parent stays valid. All other nodes
+    // get appended, node i of the subtree ending up at first_node + i - 1.
+    //
+    u32 first_node = (u32) bvh->nodes.count;
+    bvh->nodes.reserve(bvh->nodes.count + subtree_node_count - 1);
+
+    for(s64 i = 0; i < subtree_node_count; ++i) {
+        BVH_Node node = subtree[i];
+        if(!node.is_leaf()) node.first_index += first_node - 1;
+
+        if(i == 0) {
+            bvh->nodes[root_index] = node;
+        } else {
+            bvh->nodes.add(node);
+        }
+    }
+
+    bvh->allocator->deallocate(subtree);
+
+    // The ancestors still contain the same references, so their bounds don't change.
+}
+
+void BVH::insert(Resizable_Array<Triangle> &triangles, void *owner) {
+    tmFunction(TM_BVH_COLOR);
+
+    this->detach_from_blob();
+
+    if(!triangles.count) return;
+
+    assert(this->entries.count + triangles.count < MAX_U32);
+
+    //
+    // Append the new entries and build a small subtree over their references, which then gets inserted into
+    // the existing tree as a whole.
+    //
+    u32 first_entry     = (u32) this->entries.count;
+    u32 first_reference = (u32) this->references.count;
+    u32 entry_count     = (u32) triangles.count;
+
+    for(Triangle &triangle : triangles) this->add(triangle, owner);
+    for(u32 i = 0; i < entry_count; ++i) this->references.add(make_reference(this, first_entry + i));
+
+    BVH_Node *subtree = (BVH_Node *) this->allocator->allocate((entry_count * 2 - 1) * sizeof(BVH_Node));
+    subtree[0].first_index = first_reference;
+    subtree[0].entry_count = entry_count;
+    // The new references aren't sorted along the Morton curve, so fall back to the SAH there. Spatial splits
+    // would need to create new references in the middle of the array, so those fall back to the SAH as well.
+    BVH_Split_Method split_method = this->split_method == BVH_SPLIT_Morton || this->split_method == BVH_SPLIT_Spatial_SAH ? BVH_SPLIT_Binned_SAH : this->split_method;
+    s64 subtree_node_count = subdivide_nodes(this, split_method, subtree, 1, 0, 1, null);
+
+    // The subdivision sorts the new references, so the blocks can only be updated afterwards.
+    this->update_triangle_blocks(first_reference, this->references.count);
+
+    if(!this->nodes.count) {
+        for(s64 i = 0; i < subtree_node_count; ++i) this->nodes.add(subtree[i]);
+    } else {
+        Resizable_Array<u32> path;
+        path.allocator = this->allocator;
+
+        u32 sibling_index = find_best_sibling(this, subtree[0].min, subtree[0].max, &path);
+
+        //
+        // The sibling moves into a new pair of nodes at the end of the array, together with the root of the
+        // new subtree. Its old slot becomes the parent of that pair, so that the links into it stay valid.
+        //
+        this->nodes.reserve(this->nodes.count + subtree_node_count + 1);
+
+        u32 pair_index = (u32) this->nodes.count;
+        this->nodes.add(this->nodes[sibling_index]);
+
+        for(s64 i = 0; i < subtree_node_count; ++i) {
+            // Node i of the subtree ends up at pair_index + 1 + i.
+            BVH_Node node = subtree[i];
+            if(!node.is_leaf()) node.first_index += pair_index + 1;
+            this->nodes.add(node);
+        }
+
+        BVH_Node *parent    = &this->nodes[sibling_index];
+        parent->first_index = pair_index;
+        parent->entry_count = 0;
+        refit_interior_node(this, parent);
+
+        // Walk back up, enlarging the ancestors and rebalancing locally.
+        for(s64 i = path.count - 1; i >= 0; --i) {
+            refit_interior_node(this, &this->nodes[path[i]]);
+            rotate_node(this, path[i]);
+        }
+
+        path.clear();
+    }
+
+    this->allocator->deallocate(subtree);
+
+    // Inserting might push the tree past the maximum depth, which the traversal stacks are sized for. In
+    // that case, only rebuild the part of the tree which got too deep, instead of paying for a full subdivide
+    // on every edit of a large scene.
+    this->depth = calculate_depth(this, 0);
+    if(this->depth > MAX_BVH_DEPTH) {
+        u32 level;
+        u32 subtree_root = find_overflowing_subtree(this, &level);
+        rebuild_subtree(this, subtree_root, level);
+        this->depth = calculate_depth(this, 0);
+        assert(this->depth <= MAX_BVH_DEPTH);
+    }
+
+#if USE_WIDE_BVH
+    this->collapse();
+#endif
+}
+
+void BVH::remove(void *owner) {
+    tmFunction(TM_BVH_COLOR);
+
+    this->detach_from_blob();
+
+    //
+    // Removed entries stay in their leaves until the next full subdivide, but they are degenerated in the
+    // triangle blocks so that they never get hit, and excluded from the bounds.
+    //
+    b8 removed_any = false;
+
+    for(s64 i = 0; i < this->entries.count; ++i) {
+        BVH_Entry *entry = &this->entries[i];
+        if(entry->removed || entry->owner != owner) continue;
+
+        entry->removed = true;
+        removed_any = true;
+    }
+
+    if(!removed_any) return;
+
+    // An entry might be referenced by multiple leaves, so just find all affected references.
+    for(s64 i = 0; i < this->references.count; ++i) {
+        if(this->entries[this->references[i].entry_index].removed) this->update_triangle_blocks(i, i + 1);
+    }
+
+    if(this->nodes.count && !refit_node(this, 0)) this->nodes.clear();
+    this->depth = this->nodes.count ? calculate_depth(this, 0) : 0; // Pruning might have made the tree shallower.
+
+#if USE_WIDE_BVH
+    this->collapse();
+#endif
+}
+
+//
+// The traversal functions below all use a fixed-size stack of node indices (or traversal entries) on the
+// C stack, so that no allocations are required while casting rays.
+//
+#define add_to_stack(...) { assert(stack_count < MAX_NODE_STACK_SIZE); stack[stack_count++] = __VA_ARGS__; }
+#define pop_stack() stack[--stack_count]
+
+static inline
+b8 ray_intersects_aabb(vec3 ray_origin, vec3 inverse_ray_direction, vec3 abs_inverse_ray_direction, vec3 min, vec3 max, real max_ray_distance, real *distance) {
+    // https://iquilezles.org/articles/intersectors/
+    vec3 box_origin             = (max + min) * .5;
+    vec3 box_half_size          = (max - min) * .5;
+    vec3 transformed_ray_origin = inverse_ray_direction * (ray_origin - box_origin);
+    vec3 projected_box_size     = abs_inverse_ray_direction * box_half_size;
+    vec3 t1 = -transformed_ray_origin - projected_box_size;
+    vec3 t2 = -transformed_ray_origin + projected_box_size;
+    real tnear = max_ignore_nan(max_ignore_nan(t1.x, t1.y), t1.z);
+    real tfar  = min_ignore_nan(min_ignore_nan(t2.x, t2.y), t2.z);
+
+    // If tnear is negative, we are inside the box.
+    *distance = max(tnear, 0.);
+    return tfar >= 0. && tnear <= tfar && tnear <= max_ray_distance;
+}
+
+struct BVH_Simd_Ray {
+    //
+    // Since we know the direction of the ray, we know in advance which of the two planes of a slab will be
+    // hit first. This lets us skip the min / max swapping in the slab test, and makes sure the inverted
+    // bounds of unused child slots always result in a miss.
+    //
+    s64 near_plane[AXIS_COUNT], far_plane[AXIS_COUNT];
+    real4 origin[AXIS_COUNT], direction[AXIS_COUNT], inverse_direction[AXIS_COUNT];
+};
+
+static inline
+void setup_simd_ray(BVH_Simd_Ray *ray, vec3 ray_origin, vec3 ray_direction) {
+    vec3 inverse_ray_direction = 1. / ray_direction;
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        b8 negative                  = inverse_ray_direction.values[axis] < 0.;
+        ray->near_plane[axis]        = negative ? axis + AXIS_COUNT : axis;
+        ray->far_plane[axis]         = negative ? axis : axis + AXIS_COUNT;
+        ray->origin[axis]            = real4_broadcast(ray_origin.values[axis]);
+        ray->direction[axis]         = real4_broadcast(ray_direction.values[axis]);
+        ray->inverse_direction[axis] = real4_broadcast(inverse_ray_direction.values[axis]);
+    }
+}
+
+static inline
+real4 real4_dot(real4 *lhs, real4 *rhs) {
+    return real4_add(real4_add(real4_mul(lhs[0], rhs[0]), real4_mul(lhs[1], rhs[1])), real4_mul(lhs[2], rhs[2]));
+}
+
+static inline
+void real4_cross(real4 *result, real4 *lhs, real4 *rhs) {
+    result[0] = real4_sub(real4_mul(lhs[1], rhs[2]), real4_mul(lhs[2], rhs[1]));
+    result[1] = real4_sub(real4_mul(lhs[2], rhs[0]), real4_mul(lhs[0], rhs[2]));
+    result[2] = real4_sub(real4_mul(lhs[0], rhs[1]), real4_mul(lhs[1], rhs[0]));
+}
+
+static inline
+u32 intersect_triangle_block(BVH_Simd_Ray *ray, BVH_Triangle_Block *block, real max_ray_distance, real4 *distances) {
+    //
+    // Double-sided Moeller-Trumbore against all triangles of the block at once. The edges have been
+    // precomputed when building the blocks. Degenerate triangles (and padding lanes) have a zero
+    // determinant, and therefore get rejected by the epsilon check (or the NaNs from the division).
+    //
+    real4 e1[AXIS_COUNT], e2[AXIS_COUNT], s[AXIS_COUNT];
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        e1[axis] = real4_load(block->e1[axis]);
+        e2[axis] = real4_load(block->e2[axis]);
+        s[axis]  = real4_sub(ray->origin[axis], real4_load(block->v0[axis]));
+    }
+
+    real4 p[AXIS_COUNT], q[AXIS_COUNT];
+    real4_cross(p, ray->direction, e2);
+    real4_cross(q, s, e1);
+
+    real4 determinant         = real4_dot(e1, p);
+    real4 inverse_determinant = real4_div(real4_broadcast(1.), determinant);
+    real4 u = real4_mul(real4_dot(s, p), inverse_determinant);
+    real4 v = real4_mul(real4_dot(ray->direction, q), inverse_determinant);
+    real4 t = real4_mul(real4_dot(e2, q), inverse_determinant);
+
+    real4 zero = real4_broadcast(0.);
+    real4 one  = real4_broadcast(1.);
+
+    u32 mask = real4_less_equal(real4_broadcast(CORE_SMALL_EPSILON * CORE_SMALL_EPSILON), real4_mul(determinant, determinant));
+    mask &= real4_less_equal(zero, u);
+    mask &= real4_less_equal(zero, v);
+    mask &= real4_less_equal(real4_add(u, v), one);
+    mask &= real4_less_equal(zero, t);
+    mask &= real4_less_equal(t, real4_broadcast(max_ray_distance));
+
+    *distances = t;
+    return mask;
+}
+
+static inline
+u32 get_triangle_block_mask(s64 block_index, s64 first_entry, s64 one_plus_last_entry) {
+    // The blocks are aligned to the references array and not to the leaves, so we need to mask out the lanes
+    // that belong to neighbouring leaves.
+    s64 first_lane_entry = block_index * BVH_TRIANGLE_BLOCK_WIDTH;
+    u32 mask = 0;
+
+    for(s64 lane = 0; lane < BVH_TRIANGLE_BLOCK_WIDTH; ++lane) {
+        s64 entry = first_lane_entry + lane;
+        if(entry >= first_entry && entry < one_plus_last_entry) mask |= (1 << lane);
+    }
+
+    return mask;
+}
+
+static
+b8 occluded_leaf(BVH *bvh, BVH_Simd_Ray *ray, s64 first_entry, s64 entry_count, real max_ray_distance, BVH_Traversal_Counters *counters = null) {
+    s64 one_plus_last_entry = first_entry + entry_count;
+    s64 first_block = first_entry / BVH_TRIANGLE_BLOCK_WIDTH;
+    s64 last_block  = (one_plus_last_entry - 1) / BVH_TRIANGLE_BLOCK_WIDTH;
+
+    for(s64 i = first_block; i <= last_block; ++i) {
+        if(counters) counters->triangle_tests += min(one_plus_last_entry, (i + 1) * BVH_TRIANGLE_BLOCK_WIDTH) - max(first_entry, i * BVH_TRIANGLE_BLOCK_WIDTH);
+
+        real4 distances;
+        u32 hit_mask = intersect_triangle_block(ray, &bvh->triangle_blocks[i], max_ray_distance, &distances);
+        if(hit_mask & get_triangle_block_mask(i, first_entry, one_plus_last_entry)) return true;
+    }
+
+    return false;
+}
+
+static
+void closest_hit_leaf(BVH *bvh, BVH_Simd_Ray *ray, s64 first_entry, s64 entry_count, real *closest_distance, BVH_Cast_Result *result) {
+    s64 one_plus_last_entry = first_entry + entry_count;
+    s64 first_block = first_entry / BVH_TRIANGLE_BLOCK_WIDTH;
+    s64 last_block  = (one_plus_last_entry - 1) / BVH_TRIANGLE_BLOCK_WIDTH;
+
+    for(s64 i = first_block; i <= last_block; ++i) {
+        real4 wide_distances;
+        u32 hit_mask = intersect_triangle_block(ray, &bvh->triangle_blocks[i], *closest_distance, &wide_distances);
+        hit_mask &= get_triangle_block_mask(i, first_entry, one_plus_last_entry);
+        if(!hit_mask) continue;
+
+        real distances[BVH_TRIANGLE_BLOCK_WIDTH];
+        real4_store(distances, wide_distances);
+
+        for(s64 lane = 0; lane < BVH_TRIANGLE_BLOCK_WIDTH; ++lane) {
+            if(!(hit_mask & (1 << lane)) || distances[lane] > *closest_distance) continue;
+
+            result->hit_something = true;
+            result->hit_distance  = distances[lane];
+            result->hit_triangle  = &bvh->entries[bvh->references[i * BVH_TRIANGLE_BLOCK_WIDTH + lane].entry_index].triangle;
+            *closest_distance     = distances[lane];
+        }
+    }
+}
+
+static
+b8 occluded_binary(BVH *bvh, vec3 ray_origin, vec3 ray_direction, real max_ray_distance, BVH_Traversal_Counters *counters = null) {
+    if(counters) ++counters->ray_count;
+    if(!bvh->nodes.count) return false;
+
+    vec3 inverse_ray_direction = 1. / ray_direction;
+    vec3 abs_inverse_ray_direction = vec3(fabs(inverse_ray_direction.x), fabs(inverse_ray_direction.y), fabs(inverse_ray_direction.z));
+
+    BVH_Simd_Ray ray;
+    setup_simd_ray(&ray, ray_origin, ray_direction);
+    
+    const s32 MAX_NODE_STACK_SIZE = BVH_BINARY_STACK_SIZE;
+    u32 stack[MAX_NODE_STACK_SIZE];
+    s32 stack_count = 0;
+
+    BVH_Node *nodes = bvh->nodes.data;
+    
+    add_to_stack(0);
+
+    while(stack_count) {
+        BVH_Node *node = &nodes[pop_stack()];
+        if(counters) ++counters->node_visits;
+
+        real distance;
+        if(!ray_intersects_aabb(ray_origin, inverse_ray_direction, abs_inverse_ray_direction, node->min, node->max, max_ray_distance, &distance)) continue;
+        
+        if(node->is_leaf()) {
+            if(occluded_leaf(bvh, &ray, node->first_index, node->entry_count, max_ray_distance, counters)) return true;
+        } else {
+            // Order doesn't matter here, since any hit will do.
+            add_to_stack(node->first_index + 0);
+            add_to_stack(node->first_index + 1);
+        }
+    }
+
+    return false;
+}
+
+static
+BVH_Cast_Result closest_hit_binary(BVH *bvh, vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {
+    BVH_Cast_Result result;
+    result.hit_something = false;
+    result.hit_distance  = MAX_F32;
+    result.hit_triangle  = null;
+
+    if(!bvh->nodes.count) return result;
+
+    vec3 inverse_ray_direction = 1. / ray_direction;
+    vec3 abs_inverse_ray_direction = vec3(fabs(inverse_ray_direction.x), fabs(inverse_ray_direction.y), fabs(inverse_ray_direction.z));
+
+    BVH_Simd_Ray ray;
+    setup_simd_ray(&ray, ray_origin, ray_direction);
+    
+    const s32 MAX_NODE_STACK_SIZE = BVH_BINARY_STACK_SIZE;
+    BVH_Traversal_Entry stack[MAX_NODE_STACK_SIZE];
+    s32 stack_count = 0;
+
+    BVH_Node *nodes = bvh->nodes.data;
+
+    real closest_distance = max_ray_distance;
+    real root_distance;
+    if(!ray_intersects_aabb(ray_origin, inverse_ray_direction, abs_inverse_ray_direction, nodes[0].min, nodes[0].max, closest_distance, &root_distance)) return result;
+    
+    add_to_stack(BVH_Traversal_Entry { 0, root_distance });
+
+    while(stack_count) {
+        BVH_Traversal_Entry head = pop_stack();
+
+        // We might have found a closer hit since this node was pushed.
+        if(head.distance > closest_distance) continue;
+        
+        BVH_Node *node = &nodes[head.node_index];
+
+        if(node->is_leaf()) {
+            closest_hit_leaf(bvh, &ray, node->first_index, node->entry_count, &closest_distance, &result);
+        } else {
+            BVH_Traversal_Entry left  = { node->first_index + 0, 0 };
+            BVH_Traversal_Entry right = { node->first_index + 1, 0 };
+            b8 hit_left  = ray_intersects_aabb(ray_origin, inverse_ray_direction, abs_inverse_ray_direction, nodes[left.node_index].min,  nodes[left.node_index].max,  closest_distance, &left.distance);
+            b8 hit_right = ray_intersects_aabb(ray_origin, inverse_ray_direction, abs_inverse_ray_direction, nodes[right.node_index].min, nodes[right.node_index].max, closest_distance, &right.distance);
+
+            // Push the farther child first, so that the nearer one gets visited first.
+            if(hit_left && hit_right) {
+                if(left.distance <= right.distance) {
+                    add_to_stack(right);
+                    add_to_stack(left);
+                } else {
+                    add_to_stack(left);
+                    add_to_stack(right);
+                }
+            } else if(hit_left) {
+                add_to_stack(left);
+            } else if(hit_right) {
+                add_to_stack(right);
+            }
+        }
+    }
+    
+    return result;
+}
+
+static inline
+u32 intersect_wide_node(BVH_Simd_Ray *ray, BVH_Wide_Node *node, real max_ray_distance, real4 *distances) {
+    // Test the ray against all children at once. NaNs (from 0 * inf) get ignored by always passing the
+    // accumulated value as the second operand, see simd.h.
+    real4 tnear = real4_broadcast(0.);
+    real4 tfar  = real4_broadcast(max_ray_distance);
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        real4 t0 = real4_mul(real4_sub(real4_load_f32(node->bounds[ray->near_plane[axis]]), ray->origin[axis]), ray->inverse_direction[axis]);
+        real4 t1 = real4_mul(real4_sub(real4_load_f32(node->bounds[ray->far_plane[axis]]),  ray->origin[axis]), ray->inverse_direction[axis]);
+        tnear = real4_max(t0, tnear);
+        tfar  = real4_min(t1, tfar);
+    }
+
+    *distances = tnear;
+    return real4_less_equal(tnear, tfar);
+}
+
+static
+b8 occluded_wide(BVH *bvh, vec3 ray_origin, vec3 ray_direction, real max_ray_distance, BVH_Traversal_Counters *counters = null) {
+    if(counters) ++counters->ray_count;
+    if(!bvh->wide_nodes.count) return false;
+
+    BVH_Simd_Ray ray;
+    setup_simd_ray(&ray, ray_origin, ray_direction);
+    
+    const s32 MAX_NODE_STACK_SIZE = BVH_WIDE_STACK_SIZE;
+    u32 stack[MAX_NODE_STACK_SIZE];
+    s32 stack_count = 0;
+
+    BVH_Wide_Node *nodes = bvh->wide_nodes.data;
+
+    add_to_stack(0);
+
+    while(stack_count) {
+        BVH_Wide_Node *node = &nodes[pop_stack()];
+        if(counters) ++counters->node_visits;
+
+        real4 distances;
+        u32 hit_mask = intersect_wide_node(&ray, node, max_ray_distance, &distances);
+
+        for(s64 i = 0; i < BVH_WIDTH; ++i) {
+            if(!(hit_mask & (1 << i))) continue;
+
+            if(node->entry_count[i]) {
+                if(occluded_leaf(bvh, &ray, node->first_index[i], node->entry_count[i], max_ray_distance, counters)) return true;
+            } else {
+                add_to_stack(node->first_index[i]);
+            }
+        }
+    }
+
+    return false;
+}
+
+static
+BVH_Cast_Result closest_hit_wide(BVH *bvh, vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {
+    BVH_Cast_Result result;
+    result.hit_something = false;
+    result.hit_distance  = MAX_F32;
+    result.hit_triangle  = null;
+
+    if(!bvh->wide_nodes.count) return result;
+
+    BVH_Simd_Ray ray;
+    setup_simd_ray(&ray, ray_origin, ray_direction);
+    
+    const s32 MAX_NODE_STACK_SIZE = BVH_WIDE_STACK_SIZE;
+    BVH_Traversal_Entry stack[MAX_NODE_STACK_SIZE];
+    s32 stack_count = 0;
+
+    BVH_Wide_Node *nodes = bvh->wide_nodes.data;
+
+    real closest_distance = max_ray_distance;
+    
+    add_to_stack(BVH_Traversal_Entry { 0, 0. });
+
+    while(stack_count) {
+        BVH_Traversal_Entry head = pop_stack();
+        
+        // We might have found a closer hit since this node was pushed.
+        if(head.distance > closest_distance) continue;
+
+        BVH_Wide_Node *node = &nodes[head.node_index];
+
+        real4 wide_distances;
+        u32 hit_mask = intersect_wide_node(&ray, node, closest_distance, &wide_distances);
+        if(!hit_mask) continue;
+
+        real distances[BVH_WIDTH];
+        real4_store(distances, wide_distances);
+
+        //
+        // Sort the hit children front-to-back (there are at most BVH_WIDTH of them, so insertion sort is
+        // plenty).
+        //
+        s64 order[BVH_WIDTH];
+        s64 order_count = 0;
+
+        for(s64 i = 0; i < BVH_WIDTH; ++i) {
+            if(!(hit_mask & (1 << i))) continue;
+
+            s64 j = order_count++;
+            while(j > 0 && distances[order[j - 1]] > distances[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+
+            order[j] = i;
+        }
+
+        // Test the leaves first in front-to-back order, since they might shrink the ray for the interior
+        // children.
+        for(s64 k = 0; k < order_count; ++k) {
+            s64 i = order[k];
+            if(!node->entry_count[i] || distances[i] > closest_distance) continue;
+
+            closest_hit_leaf(bvh, &ray, node->first_index[i], node->entry_count[i], &closest_distance, &result);
+        }
+
+        // Push the interior children back-to-front, so that the nearest one gets popped first.
+        for(s64 k = order_count - 1; k >= 0; --k) {
+            s64 i = order[k];
+            if(node->entry_count[i] || distances[i] > closest_distance) continue;
+
+            add_to_stack(BVH_Traversal_Entry { node->first_index[i], distances[i] });
+        }
     }
 
- early_exit:
-    
     return result;
 }
 
+static
+u32 cast_rays_binary(BVH *bvh, BVH_Ray_Packet *packet) {
+    // The binary BVH doesn't have a shared packet traversal, so just trace the rays one after the other.
+    u32 occluded_mask = 0;
+
+    for(s64 i = 0; i < packet->count; ++i) {
+        if(occluded_binary(bvh, packet->origin[i], packet->direction[i], packet->max_distance[i])) occluded_mask |= (1 << i);
+    }
+
+    return occluded_mask;
+}
+
+static
+u32 cast_rays_wide(BVH *bvh, BVH_Ray_Packet *packet) {
+    if(!bvh->wide_nodes.count || !packet->count) return 0;
+
+    BVH_Simd_Ray rays[BVH_PACKET_SIZE];
+    for(s64 i = 0; i < packet->count; ++i) {
+        setup_simd_ray(&rays[i], packet->origin[i], packet->direction[i]);
+    }
+
+    //
+    // All rays of the packet traverse the tree together. Every node on the stack remembers which rays have
+    // actually hit it, so that the others can skip the node entirely. Rays which have already been occluded
+    // get dropped from all nodes.
+    //
+    const s32 MAX_NODE_STACK_SIZE = BVH_WIDE_STACK_SIZE;
+    BVH_Packet_Traversal_Entry stack[MAX_NODE_STACK_SIZE];
+    s32 stack_count = 0;
+
+    BVH_Wide_Node *nodes = bvh->wide_nodes.data;
+
+    u32 all_rays_mask = (u32) ((1ull << packet->count) - 1);
+    u32 occluded_mask = 0;
+    
+    add_to_stack(BVH_Packet_Traversal_Entry { 0, all_rays_mask });
+
+    while(stack_count) {
+        BVH_Packet_Traversal_Entry head = pop_stack();
+
+        u32 active_mask = head.ray_mask & ~occluded_mask;
+        if(!active_mask) continue;
+
+        BVH_Wide_Node *node = &nodes[head.node_index];
+
+        u32 child_masks[BVH_WIDTH] = { 0 };
+
+        for(s64 i = 0; i < packet->count; ++i) {
+            if(!(active_mask & (1 << i))) continue;
+
+            real4 distances;
+            u32 hit_mask = intersect_wide_node(&rays[i], node, packet->max_distance[i], &distances);
+
+            for(s64 j = 0; j < BVH_WIDTH; ++j) {
+                if(hit_mask & (1 << j)) child_masks[j] |= (1 << i);
+            }
+        }
+
+        for(s64 j = 0; j < BVH_WIDTH; ++j) {
+            if(!child_masks[j]) continue;
+            
+            if(node->entry_count[j]) {
+                for(s64 i = 0; i < packet->count; ++i) {
+                    if(!(child_masks[j] & (1 << i)) || (occluded_mask & (1 << i))) continue;
+
+                    if(occluded_leaf(bvh, &rays[i], node->first_index[j], node->entry_count[j], packet->max_distance[i])) occluded_mask |= (1 << i);
+                }
+
+                if(occluded_mask == all_rays_mask) return occluded_mask;
+            } else {
+                add_to_stack(BVH_Packet_Traversal_Entry { node->first_index[j], child_masks[j] });
+            }
+        }
+    }
+
+    return occluded_mask;
+}
+
+#undef add_to_stack
+#undef pop_stack
+
+b8 BVH::occluded(vec3 ray_origin, vec3 ray_direction, real max_ray_distance, BVH_Traversal_Counters *counters) {
+#if USE_WIDE_BVH
+    return occluded_wide(this, ray_origin, ray_direction, max_ray_distance, counters);
+#else
+    return occluded_binary(this, ray_origin, ray_direction, max_ray_distance, counters);
+#endif
+}
+
+BVH_Cast_Result BVH::closest_hit(vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {
+#if USE_WIDE_BVH
+    return closest_hit_wide(this, ray_origin, ray_direction, max_ray_distance);
+#else
+    return closest_hit_binary(this, ray_origin, ray_direction, max_ray_distance);
+#endif
+}
+
+u32 BVH::cast_rays(BVH_Ray_Packet *packet) {
+#if USE_WIDE_BVH
+    return cast_rays_wide(this, packet);
+#else
+    return cast_rays_binary(this, packet);
+#endif
+}
+
+b8 BVH_Query::overlaps(vec3 node_min, vec3 node_max) {
+    if(this->kind == BVH_QUERY_Sphere) {
+        // The squared distance from the center to the closest point in the box.
+        real distance_squared = 0.;
+        for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+            real closest = clamp(this->center.values[axis], node_min.values[axis], node_max.values[axis]);
+            real delta   = this->center.values[axis] - closest;
+            distance_squared += delta * delta;
+        }
+
+        return distance_squared <= this->radius * this->radius;
+    }
+
+    return this->min.x <= node_max.x && this->min.y <= node_max.y && this->min.z <= node_max.z &&
+        this->max.x >= node_min.x && this->max.y >= node_min.y && this->max.z >= node_min.z;
+}
+
+BVH_Node *BVH_Leaf_Iterator::next() {
+    while(this->stack_count) {
+        BVH_Node *node = &this->bvh->nodes[this->stack[--this->stack_count]];
+        if(!this->query.overlaps(node->min, node->max)) continue;
+
+        if(node->is_leaf()) return node;
+
+        // Push the right child first, so that the leaves come out in depth-first order.
+        assert(this->stack_count + 2 <= ARRAY_COUNT(this->stack));
+        this->stack[this->stack_count++] = node->first_index + 1;
+        this->stack[this->stack_count++] = node->first_index + 0;
+    }
+
+    return null;
+}
+
 Resizable_Array<BVH_Node *> BVH::find_leafs_at_position(Allocator *allocator, vec3 position) {
     Resizable_Array<BVH_Node *> result;
     result.allocator = allocator;
-    find_leafs_at_position_helper(result, &this->root, position);
+
+    BVH_Leaf_Iterator iterator = this->query_position(position);
+    while(BVH_Node *leaf = iterator.next()) result.add(leaf);
+    
     return result;
 }
 
-BVH_Stats BVH::stats() {
+BVH_Leaf_Iterator BVH::query_position(vec3 position) {
+    BVH_Query query;
+    query.kind = BVH_QUERY_Point;
+    query.min  = position;
+    query.max  = position;
+    return make_leaf_iterator(this, query);
+}
+
+BVH_Leaf_Iterator BVH::query_aabb(vec3 min, vec3 max) {
+    BVH_Query query;
+    query.kind = BVH_QUERY_AABB;
+    query.min  = min;
+    query.max  = max;
+    return make_leaf_iterator(this, query);
+}
+
+BVH_Leaf_Iterator BVH::query_sphere(vec3 center, real radius) {
+    BVH_Query query;
+    query.kind   = BVH_QUERY_Sphere;
+    query.center = center;
+    query.radius = radius;
+    return make_leaf_iterator(this, query);
+}
+
+void BVH::visit_leafs_at_position(vec3 position, BVH_Leaf_Visitor visitor, void *user_data) {
+    BVH_Leaf_Iterator iterator = this->query_position(position);
+    while(BVH_Node *leaf = iterator.next()) visitor(leaf, user_data);
+}
+
+void BVH::visit_leafs_in_aabb(vec3 min, vec3 max, BVH_Leaf_Visitor visitor, void *user_data) {
+    BVH_Leaf_Iterator iterator = this->query_aabb(min, max);
+    while(BVH_Node *leaf = iterator.next()) visitor(leaf, user_data);
+}
+
+void BVH::visit_leafs_in_sphere(vec3 center, real radius, BVH_Leaf_Visitor visitor, void *user_data) {
+    BVH_Leaf_Iterator iterator = this->query_sphere(center, radius);
+    while(BVH_Node *leaf = iterator.next()) visitor(leaf, user_data);
+}
+
+BVH_Stats BVH::stats(b8 include_epo) {
     BVH_Stats stats;
-    stats.max_leaf_depth      = 0;
-    stats.min_leaf_depth      = MAX_S64;
-    stats.max_entries_in_leaf = 0;
-    stats.min_entries_in_leaf = MAX_S64;
-    stats.total_node_count    = 0;
-    stats.total_entry_count   = this->entries.count;
-    stats.average_shrinkage   = 0.;
+    stats.max_leaf_depth        = 0;
+    stats.min_leaf_depth        = MAX_S64;
+    stats.max_entries_in_leaf   = 0;
+    stats.min_entries_in_leaf   = MAX_S64;
+    stats.total_node_count      = 0;
+    stats.total_entry_count     = this->entries.count;
+    stats.total_reference_count = this->references.count;
+    stats.average_shrinkage     = 0.;
+    stats.sah_cost              = 0.;
+    stats.overlap_cost          = 0.;
+    stats.epo_cost              = 0.;
+
+    if(!this->nodes.count) return stats;
     
-    this->root.update_stats(null, &stats, 0);
+    this->nodes[0].update_stats(this, null, &stats, 0);
 
     stats.average_shrinkage /= (real) stats.total_node_count;
+
+    real root_area = this->nodes[0].surface_area();
+    if(root_area > 0.) {
+        stats.sah_cost     /= root_area;
+        stats.overlap_cost /= root_area;
+    }
+
+    // The EPO walks the tree several times per triangle, so it is only estimated on request.
+    if(include_epo) stats.epo_cost = estimate_epo_cost(this);
     
     return stats;
 }
 
-void BVH::print_stats() {
-    auto stats = this->stats();
+void BVH::print_stats(b8 include_epo) {
+    auto stats = this->stats(include_epo);
 
     printf("------------ BVH ------------\n");
     printf("  > Max Depth:   %" PRId64 "\n", stats.max_leaf_depth);
@@ -333,23 +2612,142 @@ void BVH::print_stats() {
     printf("  > Max Entries: %" PRId64 "\n", stats.max_entries_in_leaf);
     printf("  > Min Entries: %" PRId64 "\n", stats.min_entries_in_leaf);
     printf("  > Node Count:  %" PRId64 "\n", stats.total_node_count);
+    printf("  > References:  %" PRId64 "\n", stats.total_reference_count);
     printf("  > Avg Shrink:  %f\n", stats.average_shrinkage);
+    printf("  > SAH Cost:    %f\n", stats.sah_cost);
+    printf("  > Overlap:     %f\n", stats.overlap_cost);
+    if(include_epo) printf("  > EPO Cost:    %f\n", stats.epo_cost);
     printf("-----------------------------\n");
 }
 
-BVH_Cast_Result cast_ray_against_entry(BVH_Entry *entry, vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {
-    BVH_Cast_Result result;
-    auto triangle_result = ray_double_sided_triangle_intersection(ray_origin, ray_direction, entry->triangle.p0, entry->triangle.p1, entry->triangle.p2);
-                
-    if(triangle_result.intersection && triangle_result.distance >= 0. && triangle_result.distance <= max_ray_distance) {
-        result.hit_something = true;
-        result.hit_distance  = triangle_result.distance;
-        result.hit_triangle  = &entry->triangle;
-    } else {
-        result.hit_something = false;
+u64 BVH::hash_entries(BVH_Owner_To_Id owner_to_id, void *user_data) {
+    u64 hash = FNV1A_OFFSET_BASIS;
+
+    for(BVH_Entry &entry : this->entries) {
+        if(entry.removed) continue;
+        hash = fnv1a_hash(hash, entry.triangle.p0.values, sizeof(entry.triangle.p0.values));
+        hash = fnv1a_hash(hash, entry.triangle.p1.values, sizeof(entry.triangle.p1.values));
+        hash = fnv1a_hash(hash, entry.triangle.p2.values, sizeof(entry.triangle.p2.values));
+
+        if(owner_to_id) {
+            // The owner ids are resolved by index when mapping the blob, so a blob whose triangles moved to
+            // different owners is just as out of date as one with different triangles.
+            u64 owner_id = encode_blob_owner(this, entry.owner, owner_to_id, user_data);
+            hash = fnv1a_hash(hash, &owner_id, sizeof(owner_id));
+        }
     }
 
-    return result;
+    return hash;
+}
+
+s64 BVH::get_blob_size() {
+    s64 size = align_blob_offset(sizeof(BVH_Blob_Header));
+    size += align_blob_offset(this->nodes.count * sizeof(BVH_Node));
+    size += align_blob_offset(this->wide_nodes.count * sizeof(BVH_Wide_Node));
+    size += align_blob_offset(this->entries.count * sizeof(BVH_Entry));
+    size += align_blob_offset(this->references.count * sizeof(BVH_Reference));
+    size += align_blob_offset(this->triangle_blocks.count * sizeof(BVH_Triangle_Block));
+    return size;
+}
+
+s64 BVH::write_blob(void *buffer, s64 buffer_size, BVH_Owner_To_Id owner_to_id, void *user_data) {
+    tmFunction(TM_BVH_COLOR);
+
+    s64 blob_size = this->get_blob_size();
+    if(buffer_size < blob_size) return 0;
+
+    u8 *bytes = (u8 *) buffer;
+    memset(bytes, 0, blob_size); // Keep the padding deterministic, so that equal BVHs produce equal files.
+
+    BVH_Blob_Header *header = (BVH_Blob_Header *) bytes;
+    header->magic        = BVH_BLOB_MAGIC;
+    header->version      = BVH_BLOB_VERSION;
+    header->layout       = get_blob_layout();
+    header->total_size   = blob_size;
+    header->content_hash = this->hash_entries(owner_to_id, user_data);
+    header->split_method = this->split_method;
+    header->depth        = (u32) this->depth;
+
+    s64 offset = align_blob_offset(sizeof(BVH_Blob_Header));
+    header->nodes           = write_blob_section(bytes, &offset, this->nodes.data,           this->nodes.count,           sizeof(BVH_Node));
+    header->wide_nodes      = write_blob_section(bytes, &offset, this->wide_nodes.data,      this->wide_nodes.count,      sizeof(BVH_Wide_Node));
+    header->entries         = write_blob_section(bytes, &offset, this->entries.data,         this->entries.count,         sizeof(BVH_Entry));
+    header->references      = write_blob_section(bytes, &offset, this->references.data,      this->references.count,      sizeof(BVH_Reference));
+    header->triangle_blocks = write_blob_section(bytes, &offset, this->triangle_blocks.data, this->triangle_blocks.count, sizeof(BVH_Triangle_Block));
+    assert(offset == blob_size);
+
+    BVH_Entry *entries = (BVH_Entry *) (bytes + header->entries.offset);
+    for(s64 i = 0; i < this->entries.count; ++i) {
+        entries[i].owner = (void *) (size_t) encode_blob_owner(this, entries[i].owner, owner_to_id, user_data);
+    }
+
+    return blob_size;
+}
+
+b8 BVH::map_blob(const void *blob, s64 blob_size, void **owners, s64 owner_count) {
+    tmFunction(TM_BVH_COLOR);
+
+    const BVH_Blob_Header *header = (const BVH_Blob_Header *) blob;
+    if(blob_size < (s64) sizeof(BVH_Blob_Header) || (size_t) blob % sizeof(real) != 0) return false;
+    if(header->magic != BVH_BLOB_MAGIC || header->version != BVH_BLOB_VERSION || header->layout != get_blob_layout()) return false;
+    if(header->total_size > (u64) blob_size || header->depth > MAX_BVH_DEPTH || header->entries.count >= MAX_U32) return false;
+
+    if(!blob_section_is_valid(header, header->nodes,           sizeof(BVH_Node))           ||
+       !blob_section_is_valid(header, header->wide_nodes,      sizeof(BVH_Wide_Node))      ||
+       !blob_section_is_valid(header, header->entries,         sizeof(BVH_Entry))          ||
+       !blob_section_is_valid(header, header->references,      sizeof(BVH_Reference))      ||
+       !blob_section_is_valid(header, header->triangle_blocks, sizeof(BVH_Triangle_Block))) return false;
+
+#if USE_WIDE_BVH
+    // The traversal only looks at the wide nodes, so a blob without them would never hit anything.
+    if(header->nodes.count && !header->wide_nodes.count) return false;
+#endif
+
+    if(!blob_indices_are_valid(blob, header)) return false;
+
+    this->destroy();
+    this->split_method = (BVH_Split_Method) header->split_method;
+    this->depth        = header->depth;
+
+    map_blob_section(this->nodes,           blob, header->nodes);
+    map_blob_section(this->wide_nodes,      blob, header->wide_nodes);
+    map_blob_section(this->entries,         blob, header->entries);
+    map_blob_section(this->references,      blob, header->references);
+    map_blob_section(this->triangle_blocks, blob, header->triangle_blocks);
+
+    this->blob             = blob;
+    this->blob_owners      = owners;
+    this->blob_owner_count = owner_count;
+    return true;
+}
+
+void BVH::detach_from_blob() {
+    if(!this->blob) return;
+
+    tmFunction(TM_BVH_COLOR);
+
+    copy_blob_section(this->nodes,           this->allocator);
+    copy_blob_section(this->wide_nodes,      this->allocator);
+    copy_blob_section(this->entries,         this->allocator);
+    copy_blob_section(this->references,      this->allocator);
+    copy_blob_section(this->triangle_blocks, this->allocator);
+
+    for(BVH_Entry &entry : this->entries) {
+        u64 owner_id = (u64) (size_t) entry.owner;
+        entry.owner = (owner_id > 0 && owner_id <= (u64) this->blob_owner_count) ? this->blob_owners[owner_id - 1] : null;
+    }
+
+    this->blob             = null;
+    this->blob_owners      = null;
+    this->blob_owner_count = 0;
+}
+
+void BVH_Ray_Packet::add(vec3 origin, vec3 direction, real max_distance) {
+    assert(this->count < BVH_PACKET_SIZE);
+    this->origin[this->count]       = origin;
+    this->direction[this->count]    = direction;
+    this->max_distance[this->count] = max_distance;
+    ++this->count;
 }
 
 
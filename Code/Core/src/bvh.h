@@ -1,17 +1,52 @@
 #pragma once
 
 #include "memutils.h"
+#include "jobs.h"
 #include "math/v3.h"
 
 #include "typedefs.h"
+#include "simd.h"
 
-#define MAX_BVH_DEPTH             9
+#define MAX_BVH_DEPTH             64  // A safety net against degenerate input; the builders usually stop way earlier due to the termination criteria.
 #define MIN_BVH_ENTRIES_TO_SPLIT  4
+#define MAX_BVH_ENTRIES_IN_LEAF   16  // Nodes with more entries are always split (if possible), even if the SAH claims that a leaf would be cheaper.
+#define BVH_MAX_ENTRIES_PER_JOB   1024 // Subtrees with at most this many entries are built in a job, if a job system is passed to BVH::subdivide.
+#define BVH_SAH_BIN_COUNT         16  // The number of bins per axis which are evaluated by the binned SAH builder.
+#define BVH_SAH_TRAVERSAL_COST    1.  // The relative cost of testing a ray against a node's AABB.
+#define BVH_SAH_INTERSECTION_COST 1.  // The relative cost of testing a ray against a single triangle.
+#define BVH_WIDTH                 REAL4_LANES // The number of children of a node in the collapsed wide BVH.
+#define BVH_INVALID_INDEX         MAX_U32
+#define BVH_TRIANGLE_BLOCK_WIDTH  REAL4_LANES // The number of triangles which are tested against a ray at once in a leaf.
+#define BVH_PACKET_SIZE           16  // The maximum number of rays in a BVH_Ray_Packet, so that the ray masks fit into a u32.
+#define BVH_MORTON_BITS_PER_AXIS  21  // 63-bit Morton codes.
+#define BVH_MORTON_JOB_ENTRIES    16384 // Smaller chunks aren't worth a job when computing and sorting the Morton codes.
+#define BVH_MORTON_MAX_JOBS       64
+#define BVH_MORTON_MIN_ENTRIES    65536 // World::create_bvh switches to the Morton builder for scenes with at least this many triangles.
+#define BVH_SPATIAL_SPLIT_ALPHA   0.00001 // Spatial splits are only considered if the children of the best object split overlap by more than this fraction of the root's surface area.
+#define BVH_SPATIAL_SPLIT_BUDGET  0.5 // The spatial split builder may create at most this many additional references per entry.
+#define BVH_BLOB_MAGIC            0x31424f4c42485642ull // "BVHBLOB1" in little endian.
+#define BVH_BLOB_VERSION          1
+#define BVH_BLOB_ALIGNMENT        64  // Every section of a blob starts on a cache line, so that the mapped arrays are at least as aligned as freshly allocated ones.
+
+// Every level of the tree leaves at most one sibling (or BVH_WIDTH - 1 siblings in the wide BVH) on the
+// traversal stack, so these are enough for any tree which respects MAX_BVH_DEPTH.
+#define BVH_BINARY_STACK_SIZE     (MAX_BVH_DEPTH + 1)
+#define BVH_WIDE_STACK_SIZE       ((BVH_WIDTH - 1) * MAX_BVH_DEPTH + 1)
 
 //
 // https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
+// https://jacco.ompf2.com/2022/04/21/how-to-build-a-bvh-part-3-quick-builds/
 //
 
+enum BVH_Split_Method {
+    BVH_SPLIT_Midpoint,   // Split the longest axis of the node in half.
+    BVH_SPLIT_Binned_SAH, // Evaluate the surface area heuristic on BVH_SAH_BIN_COUNT bins along every axis and pick the cheapest split.
+    BVH_SPLIT_Morton,     // Sort all entries along a Z-order curve once, and split every node at the first differing bit of its Morton codes (LBVH).
+    BVH_SPLIT_Spatial_SAH, // Like BVH_SPLIT_Binned_SAH, but large triangles may also be clipped at the split plane and referenced by both children (SBVH).
+};
+
+struct BVH;
+
 struct BVH_Stats {
     s64 max_leaf_depth;
     s64 min_leaf_depth;
@@ -19,7 +54,11 @@ struct BVH_Stats {
     s64 max_entries_in_leaf;
     s64 total_node_count;
     s64 total_entry_count;
+    s64 total_reference_count; // Larger than the entry count if spatial splits have duplicated some entries into multiple leaves.
     real average_shrinkage; // This shrinkage of a node is defined as (1 - my_volume / parent_volume). The closer this gets to 1, the more efficient the BVH representation is.
+    real sah_cost; // The expected cost of a random ray traversing this BVH, relative to the root's surface area. Lower is better, roughly the number of AABB and triangle tests per ray.
+    real overlap_cost; // The summed surface area in which siblings overlap, relative to the root's surface area. Rays through these regions have to visit both children.
+    real epo_cost; // The Effective Parallel Overlap: The expected cost of nodes which a ray visits although they don't contain the triangle it hits, estimated by sampling points on all triangles. The SAH cost ignores this, but it often predicts the actual traversal cost a lot better. Only estimated if requested from BVH::stats.
         
     void print_to_stdout();
 };
@@ -27,9 +66,40 @@ struct BVH_Stats {
 struct BVH_Entry {
     // User-supplied input
     Triangle triangle;
+    void *owner; // The object which added this triangle (e.g. a Triangulated_Plane), so that it can be removed again.
 
     // Internal processing
     vec3 center;
+    b8 removed; // :BVHRemovedEntries    Removed entries are kept in their leaf until the next subdivide, but never get hit. Code iterating the entries directly must skip them.
+};
+
+//
+// The leaves don't contain the entries directly, but a range of references into the entries array. This
+// means the builders only ever shuffle the (small) references around, and the spatial split builder can
+// reference the same entry from multiple leaves. The bounds of a reference only cover the part of the
+// triangle which lies inside the leaf, so they can be a lot smaller than the bounds of the entire triangle.
+//
+struct BVH_Reference {
+    vec3 min, max;
+    u32 entry_index;
+    u64 morton_code; // Only valid while building with BVH_SPLIT_Morton.
+};
+
+struct BVH_Ray {
+    vec3 origin;
+    vec3 direction;
+    real max_distance;
+};
+
+//
+// Optionally passed to BVH::occluded to measure how much work a ray actually did, so that builders can be
+// compared on a recorded set of rays (see benchmark.cpp). For the wide BVH, a visited node tests all of its
+// BVH_WIDTH children at once.
+//
+struct BVH_Traversal_Counters {
+    s64 ray_count;
+    s64 node_visits;
+    s64 triangle_tests; // Lanes in a triangle block which belong to a neighbouring leaf are not counted.
 };
 
 struct BVH_Cast_Result {
@@ -38,38 +108,188 @@ struct BVH_Cast_Result {
     Triangle *hit_triangle;
 };
 
+//
+// A bundle of (ideally coherent) rays, which traverse the BVH together in BVH::cast_rays. This amortizes
+// the node fetches over all rays in the packet.
+//
+struct BVH_Ray_Packet {
+    vec3 origin[BVH_PACKET_SIZE];
+    vec3 direction[BVH_PACKET_SIZE];
+    real max_distance[BVH_PACKET_SIZE];
+    s64 count;
+
+    void add(vec3 origin, vec3 direction, real max_distance);
+};
+
+//
+// All nodes are stored in a single array, with the two children of an interior node always being allocated
+// next to each other at first_index and first_index + 1. This is the only ordering the traversal relies on:
+// the builders, the subtree stitching, the Morton rotations and BVH::insert may place nodes in any other
+// order. This keeps the node small and avoids chasing pointers all over the world's pool during traversal.
+//
 struct BVH_Node {
     vec3 min, max;
-    s64 first_entry_index, entry_count;
-    BVH_Node *children[2];
-    b8 leaf;
+    u32 first_index; // For interior nodes, this is the index of the left child in the BVH's node array (the right child directly follows it). For leaves, this is the index of the first reference.
+    u32 entry_count; // Zero for interior nodes.
     
-    void update_stats(BVH_Node *parent, BVH_Stats *stats, s64 depth);
+    b8 is_leaf() { return this->entry_count > 0; }
+    void update_stats(BVH *bvh, BVH_Node *parent, BVH_Stats *stats, s64 depth);
     real volume();
+    real surface_area();
+};
+
+//
+// Spatial queries against the leaves of the binary tree, which never allocate. Either iterate the leaves:
+//     BVH_Leaf_Iterator iterator = bvh.query_aabb(min, max);
+//     while(BVH_Node *leaf = iterator.next()) { ... }
+// or pass a visitor, which gets called for every leaf overlapping the query region. Leaves only get tested
+// by their bounds, not by the triangles they contain.
+//
+enum BVH_Query_Kind {
+    BVH_QUERY_Point,
+    BVH_QUERY_AABB,
+    BVH_QUERY_Sphere,
+};
+
+struct BVH_Query {
+    BVH_Query_Kind kind;
+    vec3 min, max; // The point (min == max) or the box.
+    vec3 center;   // The sphere.
+    real radius;
+
+    b8 overlaps(vec3 node_min, vec3 node_max);
+};
+
+struct BVH_Leaf_Iterator {
+    BVH *bvh;
+    BVH_Query query;
+    u32 stack[BVH_BINARY_STACK_SIZE];
+    s64 stack_count;
+
+    BVH_Node *next(); // Returns null once all overlapping leaves have been visited.
+};
+
+typedef void(*BVH_Leaf_Visitor)(BVH_Node *leaf, void *user_data);
+
+#if CORE_SINGLE_PRECISION
+static_assert(sizeof(BVH_Node) == 32, "BVH_Node is expected to be exactly 32 bytes in single precision.");
+#endif
+
+//
+// The wide BVH is collapsed from the binary one after it has been built, by pulling up grandchildren into
+// their parent until each node has BVH_WIDTH children. The bounds of all children are stored next to
+// each other, so that a ray can be tested against all of them with a single stream of SIMD instructions.
+// Leaves are shared with the binary BVH, meaning they reference the same ranges in the references array.
+// The bounds are always stored in single precision (rounded outwards, so that they are conservative), which
+// halves the size of the node in double precision. They only get widened back to 'real' for the slab test,
+// and the triangles in the leaves are still tested in full precision.
+//
+struct BVH_Wide_Node {
+    f32 bounds[2 * AXIS_COUNT][BVH_WIDTH]; // First the min bounds for x, y, z, then the max bounds. Unused child slots have inverted bounds so that they never get hit.
+    u32 first_index[BVH_WIDTH]; // Same as BVH_Node::first_index, but interior children point into the wide node array.
+    u32 entry_count[BVH_WIDTH]; // Zero for interior children and unused slots.
+};
+
+static_assert(sizeof(BVH_Wide_Node) == 128, "BVH_Wide_Node is expected to be exactly two cache lines.");
+
+//
+// The triangles of the references array, precomputed into the layout of the Moeller-Trumbore intersection
+// test, so that the edges don't need to be recomputed for every ray. Block i holds the triangles of the
+// references [i * BVH_TRIANGLE_BLOCK_WIDTH, (i + 1) * BVH_TRIANGLE_BLOCK_WIDTH), which means the leaves don't
+// need to reference the blocks explicitly; leaves just mask out the lanes which belong to their neighbours.
+// Entries which are referenced by multiple leaves are stored once per reference.
+//
+struct BVH_Triangle_Block {
+    real v0[AXIS_COUNT][BVH_TRIANGLE_BLOCK_WIDTH];
+    real e1[AXIS_COUNT][BVH_TRIANGLE_BLOCK_WIDTH]; // p1 - p0
+    real e2[AXIS_COUNT][BVH_TRIANGLE_BLOCK_WIDTH]; // p2 - p0
+};
+
+//
+// A finished BVH, serialized into a single position-independent buffer. All links inside the BVH are already
+// indices, so the arrays are written as they are, and only located by their byte offset from the start of
+// the blob. A blob can therefore be written to disk and memory-mapped back (see BVH::map_blob) without any
+// fix-ups. The only pointers in the BVH are the owners of the entries, which are replaced by
+// (owner id + 1) in the blob (zero meaning no owner), and only get resolved once the mapped BVH is modified.
+//
+struct BVH_Blob_Section {
+    u64 offset; // In bytes, from the start of the blob.
+    u64 count;  // In elements.
+};
+
+struct BVH_Blob_Header {
+    u64 magic;
+    u32 version;
+    u32 layout; // The sizes of real and all serialized structs, so that blobs from a different precision or architecture get rejected.
+    u64 total_size;
+    u64 content_hash; // See BVH::hash_entries with the owner ids, so that callers can detect a blob which is out of date.
+    u32 split_method;
+    u32 depth;
+
+    BVH_Blob_Section nodes;
+    BVH_Blob_Section wide_nodes;
+    BVH_Blob_Section entries;
+    BVH_Blob_Section references;
+    BVH_Blob_Section triangle_blocks;
 };
 
+typedef u64(*BVH_Owner_To_Id)(void *owner, void *user_data);
+
 struct BVH {
     Allocator *allocator;
+    BVH_Split_Method split_method;
 
-    BVH_Node root;
+    Resizable_Array<BVH_Node> nodes; // The first node is the root. Empty if there are no entries.
+    s64 depth; // The number of levels in the binary tree, which must never exceed MAX_BVH_DEPTH.
+    Resizable_Array<BVH_Wide_Node> wide_nodes; // Only built if USE_WIDE_BVH is enabled. The first node is the root.
 
-    // @@Speed: It might be better to not index into this array directory in the bvh nodes, but instead have
-    // another level of indirection, so that the nodes have a continuous slice in this indirection array, but
-    // we don't shuffle the actual entries around (which might be slow...)
-    Resizable_Array<BVH_Entry> entries;
+    Resizable_Array<BVH_Entry> entries; // Stays in the order in which the triangles were added, except that subdivide() drops removed entries.
+    Resizable_Array<BVH_Reference> references; // The leaves have a continuous slice in this array, see BVH_Reference.
+    Resizable_Array<BVH_Triangle_Block> triangle_blocks; // Built from the references after subdivision, see BVH_Triangle_Block.
+
+    // If this BVH was mapped from a blob, the arrays above point into the blob and must not be resized or
+    // freed. All modifying procedures first copy the arrays into the allocator, see detach_from_blob().
+    const void *blob;
+    void **blob_owners; // Indexed by the owner ids which were assigned when serializing the blob.
+    s64 blob_owner_count;
     
-    void create(Allocator *allocator);
-    void add(Triangle triangle);
-    void subdivide();
+    void create(Allocator *allocator, BVH_Split_Method split_method);
+    void destroy();
+    void add(Triangle triangle, void *owner = null);
+    void subdivide(Job_System *job_system = null);
+    void build_triangle_blocks();
+    void update_triangle_blocks(s64 first_reference, s64 one_plus_last_reference);
+    void collapse();
+
+    // Incremental updates, which are a lot cheaper than a full subdivide but degrade the tree quality over
+    // time. refit() must be called after changing the triangles of existing entries.
+    void refit();
+    void insert(Resizable_Array<Triangle> &triangles, void *owner);
+    void remove(void *owner);
 
-    BVH_Cast_Result cast_ray(vec3 ray_origin, vec3 ray_direction, real max_ray_distance);
+    // Serialization into a BVH_Blob_Header followed by the arrays. The owner_to_id callback may be null, in
+    // which case all owners are dropped.
+    u64 hash_entries(BVH_Owner_To_Id owner_to_id = null, void *user_data = null); // Includes the owner ids if owner_to_id is given.
+    s64 get_blob_size();
+    s64 write_blob(void *buffer, s64 buffer_size, BVH_Owner_To_Id owner_to_id, void *user_data);
+    b8 map_blob(const void *blob, s64 blob_size, void **owners, s64 owner_count);
+    void detach_from_blob();
+
+    b8 occluded(vec3 ray_origin, vec3 ray_direction, real max_ray_distance, BVH_Traversal_Counters *counters = null); // Any-hit query, returns as soon as any triangle is hit.
+    BVH_Cast_Result closest_hit(vec3 ray_origin, vec3 ray_direction, real max_ray_distance); // Visits nodes front-to-back and returns the nearest hit along the ray.
+    u32 cast_rays(BVH_Ray_Packet *packet); // Any-hit query for an entire packet. Returns a mask with a bit set for every occluded ray.
     
     Resizable_Array<BVH_Node *> find_leafs_at_position(Allocator *allocator, vec3 position);
 
-    BVH_Stats stats();
-    void print_stats();
-};
+    BVH_Leaf_Iterator query_position(vec3 position);
+    BVH_Leaf_Iterator query_aabb(vec3 min, vec3 max);
+    BVH_Leaf_Iterator query_sphere(vec3 center, real radius);
+    void visit_leafs_at_position(vec3 position, BVH_Leaf_Visitor visitor, void *user_data);
+    void visit_leafs_in_aabb(vec3 min, vec3 max, BVH_Leaf_Visitor visitor, void *user_data);
+    void visit_leafs_in_sphere(vec3 center, real radius, BVH_Leaf_Visitor visitor, void *user_data);
 
-BVH_Cast_Result cast_ray_against_entry(BVH_Entry *entry, vec3 ray_origin, vec3 ray_direction, real max_ray_distance);
+    BVH_Stats stats(b8 include_epo = false); // The EPO estimate is expensive, so it is zero unless requested.
+    void print_stats(b8 include_epo = false);
+};
 
 Resizable_Array<Triangle> build_sample_triangle_mesh(Allocator *allocator); // @@Ship
@@ -164,30 +164,30 @@ void debug_draw_bvh(Dbg_Internal_Draw_Data &_internal, BVH *bvh, BVH_Node *node,
     debug_draw_cuboid_wireframe(_internal, center, half_size, dbg_bvh_depth_thickness_map[depth], color);
 
 #if DBG_DRAW_BVH_TRIANGLES
-    if(node->leaf) {
-        s64 one_plus_last = node->first_entry_index + node->entry_count;
-        for(s64 i = node->first_entry_index; i < one_plus_last; ++i) {
-            auto &entry = bvh->entries[i];
+    if(node->is_leaf()) {
+        s64 one_plus_last = node->first_index + node->entry_count;
+        for(s64 i = node->first_index; i < one_plus_last; ++i) {
+            auto &entry = bvh->entries[bvh->references[i].entry_index];
             debug_draw_triangle_wireframe(_internal, &entry.triangle, color, .01f);
         }
     }
 #endif
 
-    if(!node->leaf) {
-        if(node->children[0]) debug_draw_bvh(_internal, bvh, node->children[0], min(depth + 1, ARRAY_COUNT(dbg_bvh_depth_color_map) - 1), true);
-        if(node->children[1]) debug_draw_bvh(_internal, bvh, node->children[1], min(depth + 1, ARRAY_COUNT(dbg_bvh_depth_color_map) - 1), false);
+    if(!node->is_leaf()) {
+        debug_draw_bvh(_internal, bvh, &bvh->nodes[node->first_index + 0], min(depth + 1, ARRAY_COUNT(dbg_bvh_depth_color_map) - 1), true);
+        debug_draw_bvh(_internal, bvh, &bvh->nodes[node->first_index + 1], min(depth + 1, ARRAY_COUNT(dbg_bvh_depth_color_map) - 1), false);
     }
 }
 
 static
 void debug_draw_bvh(Dbg_Internal_Draw_Data &_internal, BVH *bvh) {
     _internal.bvh_node_counter = 0;
-    debug_draw_bvh(_internal, bvh, &bvh->root, 0, true);
+    if(bvh->nodes.count) debug_draw_bvh(_internal, bvh, &bvh->nodes[0], 0, true);
 }
 
 static
 void debug_draw_flood_fill_cell_center(Dbg_Internal_Draw_Data &_internal, Flood_Fill *ff, vec3 center, Dbg_Draw_Color color) {
-    real half_size = .1 * ff->cell_world_space_size;
+    real half_size = .1 * ff->grid->cell_world_space_size;
     f32 thickness = (f32) (half_size / 4.f);
     debug_draw_line(_internal, center - vec3(half_size, 0., 0.), center + vec3(half_size, 0., 0.), thickness, color);
     debug_draw_line(_internal, center - vec3(0., half_size, 0.), center + vec3(0., half_size, 0.), thickness, color);
@@ -196,22 +196,22 @@ void debug_draw_flood_fill_cell_center(Dbg_Internal_Draw_Data &_internal, Flood_
 
 static
 void debug_draw_flood_fill(Dbg_Internal_Draw_Data &_internal, Flood_Fill *ff) {
-	for(s32 x = 0; x < ff->hx; ++x) {
-        for(s32 y = 0; y < ff->hy; ++y) {
-            for(s32 z = 0; z < ff->hz; ++z) {
+	for(s32 x = 0; x < ff->grid->hx; ++x) {
+        for(s32 y = 0; y < ff->grid->hy; ++y) {
+            for(s32 z = 0; z < ff->grid->hz; ++z) {
                 vec3 center = get_cell_world_space_center(ff, v3i(x, y, z));
 
                 //
                 // Draw the outline. Only draw the "required" lines to avoid a lot of overhead by duplicate lines.
                 //
                 {
-					real half_size       = ff->cell_world_space_size / 2.f;
+					real half_size       = ff->grid->cell_world_space_size / 2.f;
 					f32 thickness        = dbg_flood_fill_cell_thickness;
 					Dbg_Draw_Color color = dbg_flood_fill_cell_color;
                     
-                    b8 endx = x + 1 == ff->hx;
-                    b8 endy = y + 1 == ff->hy;
-                    b8 endz = z + 1 == ff->hz;
+                    b8 endx = x + 1 == ff->grid->hx;
+                    b8 endy = y + 1 == ff->grid->hy;
+                    b8 endz = z + 1 == ff->grid->hz;
 
                     b8 startx = x == 0;
                     b8 startz = z == 0;
@@ -242,8 +242,7 @@ void debug_draw_flood_fill(Dbg_Internal_Draw_Data &_internal, Flood_Fill *ff) {
                 // Draw the center indicating the state of the cell.
                 //
                 {
-                    Cell *cell = get_cell(ff, v3i(x, y, z));
-                    switch(cell->state) {
+                    switch(get_cell_state(ff, v3i(x, y, z))) {
                     case CELL_Untouched: break;
 
                     case CELL_Currently_In_Frontier:
@@ -252,7 +251,6 @@ void debug_draw_flood_fill(Dbg_Internal_Draw_Data &_internal, Flood_Fill *ff) {
                         
                     case CELL_Has_Been_Flooded:
                         debug_draw_flood_fill_cell_center(_internal, ff, center, dbg_cell_flooded_color);
-                        //_internal.lines.add({ center, dbg_v3f(get_cell_world_space_center(ff, cell->added_from_cell)), dbg_cell_relation_thickness, dbg_cell_relation_color.r, dbg_cell_relation_color.r, dbg_cell_relation_color.b }); // Draw a connection between the cell that added this cell to the frontier.
                         break;
                     }
                 }
@@ -3,58 +3,578 @@
 
 #include "timing.h"
 
+#if FOUNDATION_WIN32
+# include <intrin.h>
+#endif
+
+
+/* ---------------------------------------------- Implementation ---------------------------------------------- */
+
+static inline
+s32 get_grid_dimension(Cell_Grid *grid, s64 axis) {
+    return axis == AXIS_POSITIVE_X ? grid->hx : (axis == AXIS_POSITIVE_Y ? grid->hy : grid->hz);
+}
+
+static inline
+b8 cell_is_in_grid(Cell_Grid *grid, v3i position) {
+    return position.x >= 0 && position.x < grid->hx && position.y >= 0 && position.y < grid->hy && position.z >= 0 && position.z < grid->hz;
+}
+
+static inline
+s64 get_neighbour_cell_index(Cell_Grid *grid, s64 index, v3i position, s64 axis, s64 direction) {
+    // :CellBricks
+    // Inside of a brick, the neighbour is just a local stride away. At the border of a brick, it is at the
+    // opposite end of the neighbouring brick.
+    s64 local = position.values[axis] % grid->brick_sizes[axis];
+    if(direction > 0 ? local + 1 < grid->brick_sizes[axis] : local > 0) return index + direction * grid->local_strides[axis];
+
+    return index + direction * (grid->brick_strides[axis] * CELLS_PER_BRICK - (grid->brick_sizes[axis] - 1) * grid->local_strides[axis]);
+}
+
+/* ------------------------------------------------- Atomics ------------------------------------------------- */
+
+// :ParallelFlood
+#if FOUNDATION_WIN32
+static inline
+u64 atomic_or(u64 *word, u64 bits) {
+    return (u64) _InterlockedOr64((volatile long long *) word, (long long) bits);
+}
+
+static inline
+u64 atomic_xor(u64 *word, u64 bits) {
+    return (u64) _InterlockedXor64((volatile long long *) word, (long long) bits);
+}
+
+static inline
+u64 atomic_load(u64 *word) {
+    return *(volatile u64 *) word; // Volatile accesses have acquire / release semantics with MSVC.
+}
+
+static inline
+void *atomic_load_pointer(void **pointer) {
+    return *(void *volatile *) pointer;
+}
+
+static inline
+void atomic_store_pointer(void **pointer, void *value) {
+    *(void *volatile *) pointer = value;
+}
+#else
+static inline
+u64 atomic_or(u64 *word, u64 bits) {
+    return __atomic_fetch_or(word, bits, __ATOMIC_ACQ_REL);
+}
+
+static inline
+u64 atomic_xor(u64 *word, u64 bits) {
+    return __atomic_fetch_xor(word, bits, __ATOMIC_ACQ_REL);
+}
+
+static inline
+u64 atomic_load(u64 *word) {
+    return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+static inline
+void *atomic_load_pointer(void **pointer) {
+    return __atomic_load_n(pointer, __ATOMIC_ACQUIRE);
+}
+
+static inline
+void atomic_store_pointer(void **pointer, void *value) {
+    __atomic_store_n(pointer, value, __ATOMIC_RELEASE);
+}
+#endif
+
+
 
 /* ---------------------------------------------- Implementation ---------------------------------------------- */
 
+static
+void *get_or_allocate_brick(Allocator *allocator, Mutex *mutex, void **bricks, s64 brick, s64 brick_size) {
+    void *data = atomic_load_pointer(&bricks[brick]);
+    if(data) return data;
+
+    if(mutex) {
+        // Another thread might have allocated this brick while we were waiting for the lock.
+        lock(mutex);
+        data = atomic_load_pointer(&bricks[brick]);
+        if(!data) {
+            data = allocator->allocate(brick_size);
+            memset(data, 0, brick_size);
+            atomic_store_pointer(&bricks[brick], data);
+        }
+        unlock(mutex);
+    } else {
+        data = allocator->allocate(brick_size);
+        memset(data, 0, brick_size);
+        bricks[brick] = data;
+    }
+
+    return data;
+}
+
 static inline
-v3i world_space_to_cell_space(Flood_Fill *ff, vec3 world_space) {
-    vec3 scaled_relative = (world_space - ff->world_to_cell_space_transform) / vec3(ff->cell_world_space_size); // @@Speed: Use inverse instead of division.
-    return v3i((s32) clamp(round(scaled_relative.x + ff->hx / 2. - 1), 0, ff->hx - 1),
-               (s32) clamp(round(scaled_relative.y + ff->hy / 2. - 1), 0, ff->hy - 1),
-               (s32) clamp(round(scaled_relative.z + ff->hz / 2. - 1), 0, ff->hz - 1));
+u64 get_blocked_edge_row(Cell_Grid *grid, s64 axis, s64 index) {
+    // Returns the bits of the entire brick row that contains this cell.
+    u64 *brick = grid->blocked_edges[index / CELLS_PER_BRICK];
+    if(!brick) return 0;
+
+    return brick[axis * CELL_BRICK_ROWS + (index % CELLS_PER_BRICK) / CELL_BRICK_ROW_SIZE];
 }
 
 static inline
-b8 flood_fill_condition(Flood_Fill *ff, Cell *dst, Cell *src) {
-    vec3 world_space_origin    = get_cell_world_space_center(ff, src);
-    vec3 world_space_direction = get_cell_world_space_center(ff, dst) - get_cell_world_space_center(ff, src);
-    
-    return !ff->world->cast_ray_against_delimiters_and_root_planes(world_space_origin, world_space_direction, 1.f); // World space direction is scaled to reflect the actual distance between the cells, so we only care about intersections on inside this direction vector.
+b8 cell_edge_is_blocked(Cell_Grid *grid, s64 axis, s64 index) {
+    return (get_blocked_edge_row(grid, axis, index) >> (index % CELL_BRICK_ROW_SIZE)) & 1;
 }
 
 static inline
-void definitely_add_cell_to_frontier(Flood_Fill *ff, v3i position) {
-    Cell *cell = get_cell(ff, position);
-    cell->position = position;
-    cell->state = CELL_Currently_In_Frontier;
-    ff->frontier.add(cell);
+void set_cell_edge_blocked(Cell_Grid *grid, s64 axis, s64 index) {
+    u64 *brick = (u64 *) get_or_allocate_brick(grid->allocator, grid->mutex, (void **) grid->blocked_edges, index / CELLS_PER_BRICK, AXIS_COUNT * CELL_BRICK_ROWS * sizeof(u64));
+    brick[axis * CELL_BRICK_ROWS + (index % CELLS_PER_BRICK) / CELL_BRICK_ROW_SIZE] |= 1ull << (index % CELL_BRICK_ROW_SIZE);
 }
 
 static inline
-void maybe_add_cell_to_frontier(Flood_Fill *ff, Cell *src, v3i position) {
-    if(position.x < 0 || position.x >= ff->hx || position.y < 0 || position.y >= ff->hy || position.z < 0 || position.z >= ff->hz) return;
+u64 *get_state_brick(Flood_Fill *ff, s64 index) {
+    return (u64 *) atomic_load_pointer((void **) &ff->cell_states[index / CELLS_PER_BRICK]);
+}
 
-    Cell *cell = get_cell(ff, position);
-    if(cell->state != CELL_Untouched) return;
-    cell->position        = position;
-    
-    if(!flood_fill_condition(ff, cell, src)) return;
+static inline
+u64 *get_or_allocate_state_brick(Flood_Fill *ff, s64 index) {
+    // :ParallelFlood
+    // The jobs share the bricks of their parent, so they also need to allocate them through it.
+    Flood_Fill *owner = ff->parent ? ff->parent : ff;
+    return (u64 *) get_or_allocate_brick(owner->allocator, ff->parent ? owner->mutex : null, (void **) ff->cell_states, index / CELLS_PER_BRICK, CELLS_PER_BRICK / CELLS_PER_STATE_WORD * sizeof(u64));
+}
 
-    cell->state = CELL_Currently_In_Frontier;
-    ff->frontier.add(cell);
+static inline
+Cell_State get_cell_state(Flood_Fill *ff, s64 index) {
+    u64 *brick = get_state_brick(ff, index);
+    if(!brick) return CELL_Untouched;
+
+    s64 local = index % CELLS_PER_BRICK;
+    return (Cell_State) ((atomic_load(&brick[local / CELLS_PER_STATE_WORD]) >> ((local % CELLS_PER_STATE_WORD) * CELL_STATE_BITS)) & 0x3);
 }
 
 static inline
-void fill_cell(Flood_Fill *ff, Cell *cell) {
-    cell->state = CELL_Has_Been_Flooded;
-    ff->flooded_cells.add(cell);
+void set_cell_state(Flood_Fill *ff, s64 index, Cell_State state) {
+    u64 *brick = get_or_allocate_state_brick(ff, index);
+
+    s64 local  = index % CELLS_PER_BRICK;
+    u64 *word  = &brick[local / CELLS_PER_STATE_WORD];
+    u64 shift  = (local % CELLS_PER_STATE_WORD) * CELL_STATE_BITS;
 
-    maybe_add_cell_to_frontier(ff, cell, cell->position + v3i(1, 0, 0));
-    maybe_add_cell_to_frontier(ff, cell, cell->position - v3i(1, 0, 0));
-    maybe_add_cell_to_frontier(ff, cell, cell->position + v3i(0, 1, 0));
-    maybe_add_cell_to_frontier(ff, cell, cell->position - v3i(0, 1, 0));
-    maybe_add_cell_to_frontier(ff, cell, cell->position + v3i(0, 0, 1));
-    maybe_add_cell_to_frontier(ff, cell, cell->position - v3i(0, 0, 1));
+    if(ff->parent) {
+        // :ParallelFlood
+        // Other jobs might be claiming other cells in this word at the same time. Nobody else ever changes
+        // the bits of this cell once it is claimed though, so flipping exactly the changed bits is enough.
+        u64 current = (atomic_load(word) >> shift) & 0x3;
+        atomic_xor(word, (current ^ (u64) state) << shift);
+    } else {
+        *word = (*word & ~(0x3ull << shift)) | ((u64) state << shift);
+    }
+}
+
+static inline
+b8 claim_cell(Flood_Fill *ff, s64 index) {
+    // Moves an untouched cell into the frontier. Returns false if the cell has already been touched before,
+    // so that every cell only ends up in the frontier once.
+    if(!ff->parent) {
+        if(get_cell_state(ff, index) != CELL_Untouched) return false;
+        set_cell_state(ff, index, CELL_Currently_In_Frontier);
+        return true;
+    }
+
+    //
+    // :ParallelFlood
+    // Only try to claim cells which look untouched, since setting the frontier bit of a flooded cell would
+    // corrupt its state. A cell is only ever flooded one level after it has been claimed, so a cell which
+    // is still untouched here can at most be claimed by another job in the meantime, never flooded.
+    //
+    if(get_cell_state(ff, index) != CELL_Untouched) return false;
+
+    u64 *brick = get_or_allocate_state_brick(ff, index);
+
+    s64 local  = index % CELLS_PER_BRICK;
+    u64 shift  = (local % CELLS_PER_STATE_WORD) * CELL_STATE_BITS;
+    u64 before = atomic_or(&brick[local / CELLS_PER_STATE_WORD], (u64) CELL_Currently_In_Frontier << shift);
+    return ((before >> shift) & 0x3) == CELL_Untouched;
+}
+
+static
+v3i find_origin_cell(Cell_Grid *grid, vec3 world_space_position) {
+    //
+    // Since the grid is shared by all anchors, an anchor usually isn't centered on a cell. Start flooding from
+    // the closest of the eight surrounding cell centers that the anchor can actually see, so that an anchor
+    // close to a delimiter doesn't start flooding on the other side of it.
+    //
+    vec3 scaled_relative = (world_space_position + grid->cell_to_world_space_transform) / vec3(grid->cell_world_space_size);
+    v3i base = v3i((s32) floor(scaled_relative.x), (s32) floor(scaled_relative.y), (s32) floor(scaled_relative.z));
+
+    v3i closest_position = v3i((s32) clamp(round(scaled_relative.x), 0, grid->hx - 1),
+                               (s32) clamp(round(scaled_relative.y), 0, grid->hy - 1),
+                               (s32) clamp(round(scaled_relative.z), 0, grid->hz - 1));
+    real closest_distance = MAX_F32;
+
+    for(s32 i = 0; i < 8; ++i) {
+        v3i position = base + v3i(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        if(!cell_is_in_grid(grid, position)) continue;
+
+        vec3 direction = get_cell_world_space_center(grid, position) - world_space_position;
+        real distance  = v3_length2(direction);
+        if(distance >= closest_distance || grid->world->cast_ray_against_delimiters_and_root_planes(world_space_position, direction, 1.)) continue;
+
+        closest_position = position;
+        closest_distance = distance;
+    }
+
+    return closest_position;
+}
+
+static
+void cast_cell_edge_packet(Cell_Grid *grid, BVH_Ray_Packet *packet, s64 *edge_cells, s64 *edge_axes, Resizable_Array<BVH_Ray> *recorded_rays) {
+    if(recorded_rays) {
+        for(s64 i = 0; i < packet->count; ++i) recorded_rays->add({ packet->origin[i], packet->direction[i], packet->max_distance[i] });
+    }
+
+    u32 occluded_mask = grid->world->cast_rays_against_delimiters_and_root_planes(packet);
+
+    for(s64 i = 0; i < packet->count; ++i) {
+        if(occluded_mask & (1 << i)) set_cell_edge_blocked(grid, edge_axes[i], edge_cells[i]);
+    }
+
+    packet->count = 0;
+}
+
+#if USE_EDGE_RAY_CULLING
+static
+b8 brick_has_nearby_delimiters(Cell_Grid *grid, v3i first_position) {
+    //
+    // :EdgeRayCulling
+    // The edge rays of a brick start at its cell centers and end at most at the centers of the next cells on
+    // every axis. If no delimiter triangle overlaps that box (with a small margin), and the box doesn't touch
+    // the world bounds, none of these rays can ever be blocked.
+    //
+    v3i last_position = first_position + v3i((s32) grid->brick_sizes[AXIS_POSITIVE_X], (s32) grid->brick_sizes[AXIS_POSITIVE_Y], (s32) grid->brick_sizes[AXIS_POSITIVE_Z]);
+
+    vec3 margin = vec3(grid->cell_world_space_size * 0.5);
+    vec3 min    = get_cell_world_space_center(grid, first_position) - margin;
+    vec3 max    = get_cell_world_space_center(grid, last_position)  + margin;
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        if(min.values[axis] <= -grid->world->half_size.values[axis] || max.values[axis] >= grid->world->half_size.values[axis]) return true;
+    }
+
+    BVH *bvh = &grid->world->bvh;
+    BVH_Leaf_Iterator iterator = bvh->query_aabb(min, max);
+
+    while(BVH_Node *leaf = iterator.next()) {
+        // The leaf bounds are only a rough estimate, the references are a lot tighter.
+        for(u32 i = leaf->first_index; i < leaf->first_index + leaf->entry_count; ++i) {
+            BVH_Reference *reference = &bvh->references[i];
+            if(bvh->entries[reference->entry_index].removed) continue;
+            if(iterator.query.overlaps(reference->min, reference->max)) return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+static
+void grow_cell_queue(Cell_Queue *queue, Allocator *allocator) {
+    Cell_Span *data = (Cell_Span *) allocator->allocate(queue->capacity * 2 * sizeof(Cell_Span));
+
+    // Unwrap the ring buffer into the new array.
+    for(s64 i = 0; i < queue->count; ++i) data[i] = queue->data[(queue->head + i) & (queue->capacity - 1)];
+
+    allocator->deallocate(queue->data);
+    queue->data      = data;
+    queue->capacity *= 2;
+    queue->head      = 0;
+}
+
+static inline
+void push_cell_queue(Cell_Queue *queue, Allocator *allocator, Cell_Span span) {
+    if(queue->count == queue->capacity) grow_cell_queue(queue, allocator);
+    queue->data[(queue->head + queue->count) & (queue->capacity - 1)] = span;
+    ++queue->count;
+}
+
+static inline
+Cell_Span pop_cell_queue(Cell_Queue *queue) {
+    Cell_Span span = queue->data[queue->head];
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    --queue->count;
+    return span;
+}
+
+#if USE_SPANS_FOR_FLOOD_FILL
+static
+void add_span_to_frontier(Flood_Fill *ff, s64 index) {
+    //
+    // :FloodSpans
+    // Extend the span from this (already claimed) cell in both directions along the span axis, as long as the
+    // edges aren't blocked and the cells can be claimed. The span axis is the innermost axis of a brick, so
+    // these are just the neighbouring indices, up to the end of the brick row (or the grid).
+    //
+    Cell_Grid *grid = ff->grid;
+    s64 span_axis  = grid->span_axis;
+    s64 row_offset = index % CELL_BRICK_ROW_SIZE;
+    s64 row_first  = index - row_offset;
+    s64 row_last   = row_first + min(CELL_BRICK_ROW_SIZE, get_grid_dimension(grid, span_axis) - get_cell_position(grid, row_first).values[span_axis]) - 1;
+
+    s64 first = index, last = index;
+    while(first > row_first && !cell_edge_is_blocked(grid, span_axis, first - 1) && claim_cell(ff, first - 1)) --first;
+    while(last < row_last && !cell_edge_is_blocked(grid, span_axis, last) && claim_cell(ff, last + 1)) ++last;
+
+    push_cell_queue(&ff->frontier, ff->allocator, { (u32) first, (u32) (last - first + 1) });
+}
+
+static
+void add_neighbouring_row_to_frontier(Flood_Fill *ff, Cell_Span span, s64 neighbour_first, s64 edge_axis, s64 edge_first) {
+    //
+    // :CellEdgeMask
+    // The edges between the span and its neighbouring row are a consecutive range of bits in one brick row,
+    // so test all of them at once and skip over the blocked parts of the span.
+    //
+    u64 open_edges = ~get_blocked_edge_row(ff->grid, edge_axis, edge_first) >> (edge_first % CELL_BRICK_ROW_SIZE);
+    if(span.count < 64) open_edges &= (1ull << span.count) - 1;
+
+    for(s64 i = 0; open_edges; ++i, open_edges >>= 1) {
+        if(!(open_edges & 1)) continue;
+
+        s64 neighbour = neighbour_first + i;
+        if(claim_cell(ff, neighbour)) add_span_to_frontier(ff, neighbour);
+    }
+}
+
+static
+void fill_span(Flood_Fill *ff, Cell_Span span) {
+    for(s64 i = span.first; i < span.first + span.count; ++i) {
+        set_cell_state(ff, i, CELL_Has_Been_Flooded);
+        ff->flooded_cells.add((u32) i);
+    }
+
+    Cell_Grid *grid = ff->grid;
+    s64 span_axis = grid->span_axis;
+    s64 last      = span.first + span.count - 1;
+    v3i position  = get_cell_position(grid, span.first);
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        if(axis == span_axis) continue;
+
+        if(position.values[axis] + 1 < get_grid_dimension(grid, axis)) {
+            s64 neighbour_first = get_neighbour_cell_index(grid, span.first, position, axis, +1);
+            add_neighbouring_row_to_frontier(ff, span, neighbour_first, axis, span.first);
+        }
+
+        if(position.values[axis] > 0) {
+            s64 neighbour_first = get_neighbour_cell_index(grid, span.first, position, axis, -1);
+            add_neighbouring_row_to_frontier(ff, span, neighbour_first, axis, neighbour_first);
+        }
+    }
+
+    //
+    // Spans never cross a brick row, so if this span reaches the end of its row, continue into the row of the
+    // neighbouring brick on the span axis.
+    //
+    if(span.first % CELL_BRICK_ROW_SIZE == 0 && position.values[span_axis] > 0) {
+        s64 neighbour = get_neighbour_cell_index(grid, span.first, position, span_axis, -1);
+        if(!cell_edge_is_blocked(grid, span_axis, neighbour) && claim_cell(ff, neighbour)) add_span_to_frontier(ff, neighbour);
+    }
+
+    v3i last_position = position;
+    last_position.values[span_axis] += span.count - 1;
+
+    if(last % CELL_BRICK_ROW_SIZE == CELL_BRICK_ROW_SIZE - 1 && last_position.values[span_axis] + 1 < get_grid_dimension(grid, span_axis)) {
+        s64 neighbour = get_neighbour_cell_index(grid, last, last_position, span_axis, +1);
+        if(!cell_edge_is_blocked(grid, span_axis, last) && claim_cell(ff, neighbour)) add_span_to_frontier(ff, neighbour);
+    }
+}
+
+static inline
+void flood_frontier_span(Flood_Fill *ff, Cell_Span span) {
+    fill_span(ff, span);
+}
+
+static inline
+void add_origin_to_frontier(Flood_Fill *ff, s64 index) {
+    claim_cell(ff, index);
+    add_span_to_frontier(ff, index);
+}
+#else
+static inline
+void maybe_add_cell_to_frontier(Flood_Fill *ff, s64 index, s64 edge_axis, s64 edge_cell) {
+    if(cell_edge_is_blocked(ff->grid, edge_axis, edge_cell) || !claim_cell(ff, index)) return;
+    push_cell_queue(&ff->frontier, ff->allocator, { (u32) index, 1 });
+}
+
+static inline
+void fill_cell(Flood_Fill *ff, s64 index) {
+    set_cell_state(ff, index, CELL_Has_Been_Flooded);
+    ff->flooded_cells.add((u32) index);
+
+    // :CellEdgeMask
+    Cell_Grid *grid = ff->grid;
+    v3i position = get_cell_position(grid, index);
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        if(position.values[axis] + 1 < get_grid_dimension(grid, axis)) {
+            maybe_add_cell_to_frontier(ff, get_neighbour_cell_index(grid, index, position, axis, +1), axis, index);
+        }
+
+        if(position.values[axis] > 0) {
+            s64 neighbour = get_neighbour_cell_index(grid, index, position, axis, -1);
+            maybe_add_cell_to_frontier(ff, neighbour, axis, neighbour);
+        }
+    }
+}
+
+static inline
+void flood_frontier_span(Flood_Fill *ff, Cell_Span span) {
+    fill_cell(ff, span.first);
+}
+
+static inline
+void add_origin_to_frontier(Flood_Fill *ff, s64 index) {
+    claim_cell(ff, index);
+    push_cell_queue(&ff->frontier, ff->allocator, { (u32) index, 1 });
+}
+#endif
+
+static
+void reset_flood_fill(Flood_Fill *ff) {
+    ff->frontier.head  = 0;
+    ff->frontier.count = 0;
+
+    //
+    // Every cell that the previous flood touched ended up being flooded, so only the words of these cells
+    // can contain any state. Clearing them instead of the entire grid means that a small room in a huge
+    // world only pays for its own cells. The flooded cells array and the bricks keep their memory for the
+    // next anchor.
+    //
+    for(u32 index : ff->flooded_cells) {
+        u64 *brick = ff->cell_states[index / CELLS_PER_BRICK];
+        brick[(index % CELLS_PER_BRICK) / CELLS_PER_STATE_WORD] = 0;
+    }
+
+    ff->flooded_cells.count = 0;
+}
+
+struct Flood_Fill_Job {
+    Flood_Fill worker; // Shares the cell states with the parent, but has its own frontier and flooded cells (which are preallocated by the parent).
+    s64 first, one_plus_last; // The part of the parent's frontier handled by this job.
+};
+
+static
+void flood_fill_job(Flood_Fill_Job *job) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    Cell_Queue *frontier = &job->worker.parent->frontier;
+
+    for(s64 i = job->first; i < job->one_plus_last; ++i) {
+        flood_frontier_span(&job->worker, frontier->data[(frontier->head + i) & (frontier->capacity - 1)]);
+    }
+}
+
+static
+void create_flood_fill_jobs(Flood_Fill *ff) {
+    ff->jobs = (Flood_Fill_Job *) ff->allocator->allocate(ff->worker_count * sizeof(Flood_Fill_Job));
+
+    for(s64 i = 0; i < ff->worker_count; ++i) {
+        Flood_Fill *worker = &ff->jobs[i].worker;
+        *worker = *ff;
+        worker->job_system              = null;
+        worker->worker_count            = 0;
+        worker->parent                  = ff;
+        worker->jobs                    = null;
+        worker->flooded_cells           = Resizable_Array<u32>();
+        worker->flooded_cells.allocator = ff->allocator;
+        worker->frontier.capacity       = 16;
+        worker->frontier.data           = (Cell_Span *) ff->allocator->allocate(worker->frontier.capacity * sizeof(Cell_Span));
+    }
+}
+
+static
+void flood_frontier_in_parallel(Flood_Fill *ff, Flood_Fill_Job *jobs, s64 job_count) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    //
+    // :ParallelFlood
+    // Flood the entire current frontier in one go. The spans are split evenly between the jobs, which only
+    // read the parent's frontier and write into their own one.
+    //
+    s64 level_count   = ff->frontier.count;
+    s64 spans_per_job = (level_count + job_count - 1) / job_count;
+
+    for(s64 i = 0; i < job_count; ++i) {
+        Flood_Fill *worker = &jobs[i].worker;
+        jobs[i].first         = min(i * spans_per_job, level_count);
+        jobs[i].one_plus_last = min((i + 1) * spans_per_job, level_count);
+
+        //
+        // The jobs must not allocate their arrays themselves, since the allocator isn't thread-safe. A span
+        // of n cells floods exactly these cells, and can at most claim one new span per cell in each of its
+        // four neighbouring rows plus the two cells at its ends, so reserve for that up front.
+        //
+        s64 cell_count = 0;
+        for(s64 j = jobs[i].first; j < jobs[i].one_plus_last; ++j) cell_count += ff->frontier.data[(ff->frontier.head + j) & (ff->frontier.capacity - 1)].count;
+
+        s64 span_bound = 2 * (AXIS_COUNT - 1) * cell_count + 2 * (jobs[i].one_plus_last - jobs[i].first);
+
+        worker->frontier.head  = 0;
+        worker->frontier.count = 0;
+        while(worker->frontier.capacity < span_bound) grow_cell_queue(&worker->frontier, ff->allocator);
+
+        worker->flooded_cells.count = 0;
+        worker->flooded_cells.reserve(cell_count);
+    }
+
+    // Only spawn the jobs once all allocations above are done, since they allocate state bricks.
+    for(s64 i = 0; i < job_count; ++i) {
+        if(jobs[i].first < jobs[i].one_plus_last) spawn_job(ff->job_system, { (Job_Procedure) flood_fill_job, &jobs[i] });
+    }
+
+    wait_for_all_jobs(ff->job_system);
+
+    ff->frontier.head  = (ff->frontier.head + level_count) & (ff->frontier.capacity - 1);
+    ff->frontier.count = 0;
+
+    for(s64 i = 0; i < job_count; ++i) {
+        Flood_Fill *worker = &jobs[i].worker;
+
+        for(u32 index : worker->flooded_cells) ff->flooded_cells.add(index);
+        while(worker->frontier.count) push_cell_queue(&ff->frontier, ff->allocator, pop_cell_queue(&worker->frontier));
+    }
+}
+
+static
+void floodfill_from_cell(Flood_Fill *ff, v3i origin) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    reset_flood_fill(ff);
+
+    ff->origin = origin;
+
+    add_origin_to_frontier(ff, get_cell_index(ff->grid, ff->origin));
+
+    //
+    // :ParallelFlood
+    // Small frontiers aren't worth the overhead of the jobs, so these are just flooded span by span. Every
+    // span in the frontier has already been claimed, so it doesn't matter which of the two handles it.
+    //
+    assert(!ff->job_system || ff->mutex);
+
+    while(ff->frontier.count) {
+        if(ff->job_system && ff->worker_count > 1 && ff->frontier.count >= FLOOD_FILL_SPANS_PER_JOB * 2) {
+            if(!ff->jobs) create_flood_fill_jobs(ff);
+            flood_frontier_in_parallel(ff, ff->jobs, min(ff->worker_count, ff->frontier.count / FLOOD_FILL_SPANS_PER_JOB));
+        } else {
+            Cell_Span head = pop_cell_queue(&ff->frontier);
+            flood_frontier_span(ff, head);
+        }
+    }
 }
 
 
@@ -68,76 +588,273 @@ s32 ceil_to_uneven(real value) {
     return result;
 }
 
-Cell *get_cell(Flood_Fill *ff, v3i position) {
-    if(position.x < 0 || position.x >= ff->hx || position.y < 0 || position.y >= ff->hy || position.z < 0 || position.z >= ff->hz) return null;
-    
-    s64 index = position.x * ff->hy * ff->hz + position.y * ff->hz + position.z;
-    return &ff->cells[index];
+void create_cell_grid(Cell_Grid *grid, World *world, Allocator *allocator, real cell_world_space_size) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    grid->allocator             = allocator;
+    grid->mutex                 = null;
+    grid->world                 = world;
+    grid->cell_world_space_size = cell_world_space_size;
+
+    // Make sure that we have an uneven number of cells, so that the center cell is actually centered on the
+    // world origin (with an even number of cells, an edge between two cells would be centered on it).
+    grid->hx = ceil_to_uneven(world->half_size.x / grid->cell_world_space_size * 2.);
+    grid->hy = ceil_to_uneven(world->half_size.y / grid->cell_world_space_size * 2.);
+    grid->hz = ceil_to_uneven(world->half_size.z / grid->cell_world_space_size * 2.);
+    grid->cell_to_world_space_transform = vec3(grid->hx / 2, grid->hy / 2, grid->hz / 2) * grid->cell_world_space_size;
+
+    // :FloodSpans
+    // The span axis is the innermost axis of a brick, followed by the remaining two axes in order.
+    grid->span_axis = AXIS_POSITIVE_X;
+    if(grid->hy > get_grid_dimension(grid, grid->span_axis)) grid->span_axis = AXIS_POSITIVE_Y;
+    if(grid->hz > get_grid_dimension(grid, grid->span_axis)) grid->span_axis = AXIS_POSITIVE_Z;
+
+    s64 middle_axis = (grid->span_axis == AXIS_POSITIVE_Z) ? AXIS_POSITIVE_Y : AXIS_POSITIVE_Z;
+    s64 outer_axis  = (grid->span_axis == AXIS_POSITIVE_X) ? AXIS_POSITIVE_Y : AXIS_POSITIVE_X;
+
+    // :CellBricks
+    grid->brick_sizes[grid->span_axis] = CELL_BRICK_ROW_SIZE;
+    grid->brick_sizes[middle_axis]     = CELL_BRICK_SIZE;
+    grid->brick_sizes[outer_axis]      = CELL_BRICK_SIZE;
+
+    grid->local_strides[grid->span_axis] = 1;
+    grid->local_strides[middle_axis]     = CELL_BRICK_ROW_SIZE;
+    grid->local_strides[outer_axis]      = CELL_BRICK_ROW_SIZE * CELL_BRICK_SIZE;
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        grid->brick_dimensions[axis] = (get_grid_dimension(grid, axis) + grid->brick_sizes[axis] - 1) / grid->brick_sizes[axis];
+    }
+
+    grid->brick_strides[grid->span_axis] = 1;
+    grid->brick_strides[middle_axis]     = grid->brick_dimensions[grid->span_axis];
+    grid->brick_strides[outer_axis]      = grid->brick_strides[middle_axis] * grid->brick_dimensions[middle_axis];
+    grid->brick_count = grid->brick_strides[outer_axis] * grid->brick_dimensions[outer_axis];
+
+    grid->cell_count = grid->brick_count * CELLS_PER_BRICK;
+    assert(grid->cell_count <= MAX_U32); // The flood fill stores cells as 32-bit indices.
+
+    grid->blocked_edges = (u64 **) grid->allocator->allocate(grid->brick_count * sizeof(u64 *));
+    memset(grid->blocked_edges, 0, grid->brick_count * sizeof(u64 *));
+}
+
+void calculate_blocked_cell_edges(Cell_Grid *grid, s64 first_brick, s64 last_brick, Resizable_Array<BVH_Ray> *recorded_rays) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    //
+    // Cast the rays of consecutive cells as one packet. Consecutive cells are neighbours along the span axis,
+    // so these rays are very coherent.
+    // This only ever writes the bricks in [first_brick, last_brick], so different threads can work on the grid
+    // at the same time as long as their ranges don't overlap (and the grid has a mutex for the allocations).
+    //
+    BVH_Ray_Packet packet;
+    packet.count = 0;
+
+    s64 edge_cells[BVH_PACKET_SIZE];
+    s64 edge_axes[BVH_PACKET_SIZE];
+
+    for(s64 brick = first_brick; brick <= last_brick; ++brick) {
+#if USE_EDGE_RAY_CULLING
+        // :EdgeRayCulling
+        if(!brick_has_nearby_delimiters(grid, get_cell_position(grid, brick * CELLS_PER_BRICK))) continue;
+#endif
+
+        for(s64 index = brick * CELLS_PER_BRICK; index < (brick + 1) * CELLS_PER_BRICK; ++index) {
+            v3i position = get_cell_position(grid, index);
+            if(!cell_is_in_grid(grid, position)) continue; // Partial bricks at the end of the grid
+
+            vec3 world_space_origin = get_cell_world_space_center(grid, position);
+
+            for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+                if(position.values[axis] + 1 >= get_grid_dimension(grid, axis)) continue; // Edges leaving the grid are never tested by the flood fill.
+
+                // The direction is scaled to reflect the actual distance between the cells, so we only care about
+                // intersections inside of this direction vector.
+                v3i neighbour = position;
+                neighbour.values[axis] += 1;
+                vec3 world_space_direction = get_cell_world_space_center(grid, neighbour) - world_space_origin;
+
+                edge_cells[packet.count] = index;
+                edge_axes[packet.count]  = axis;
+                packet.add(world_space_origin, world_space_direction, 1.);
+
+                if(packet.count == BVH_PACKET_SIZE) cast_cell_edge_packet(grid, &packet, edge_cells, edge_axes, recorded_rays);
+            }
+        }
+    }
+
+    if(packet.count) cast_cell_edge_packet(grid, &packet, edge_cells, edge_axes, recorded_rays);
 }
 
-vec3 get_cell_world_space_center(Flood_Fill *ff, v3i position) {
-    real xoffset = position.x * ff->cell_world_space_size - ff->cell_to_world_space_transform.x;
-    real yoffset = position.y * ff->cell_world_space_size - ff->cell_to_world_space_transform.y;
-    real zoffset = position.z * ff->cell_world_space_size - ff->cell_to_world_space_transform.z;
+void destroy_cell_grid(Cell_Grid *grid) {
+    for(s64 i = 0; i < grid->brick_count; ++i) {
+        if(grid->blocked_edges[i]) grid->allocator->deallocate(grid->blocked_edges[i]);
+    }
+
+    grid->allocator->deallocate(grid->blocked_edges);
+    grid->blocked_edges = null;
+
+    grid->hx = 0;
+    grid->hy = 0;
+    grid->hz = 0;
+    grid->cell_count  = 0;
+    grid->brick_count = 0;
+}
+
+s64 get_cell_index(Cell_Grid *grid, v3i position) {
+    s64 brick = 0, local = 0;
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        brick += (position.values[axis] / grid->brick_sizes[axis]) * grid->brick_strides[axis];
+        local += (position.values[axis] % grid->brick_sizes[axis]) * grid->local_strides[axis];
+    }
+
+    return brick * CELLS_PER_BRICK + local;
+}
+
+v3i get_cell_position(Cell_Grid *grid, s64 index) {
+    s64 brick = index / CELLS_PER_BRICK, local = index % CELLS_PER_BRICK;
+
+    v3i position;
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        position.values[axis] = (s32) (((brick / grid->brick_strides[axis]) % grid->brick_dimensions[axis]) * grid->brick_sizes[axis] + (local / grid->local_strides[axis]) % grid->brick_sizes[axis]);
+    }
+
+    return position;
+}
+
+Cell_State get_cell_state(Flood_Fill *ff, v3i position) {
+    if(!cell_is_in_grid(ff->grid, position)) return CELL_Untouched;
+    return get_cell_state(ff, get_cell_index(ff->grid, position));
+}
+
+vec3 get_cell_world_space_center(Cell_Grid *grid, v3i position) {
+    real xoffset = position.x * grid->cell_world_space_size - grid->cell_to_world_space_transform.x;
+    real yoffset = position.y * grid->cell_world_space_size - grid->cell_to_world_space_transform.y;
+    real zoffset = position.z * grid->cell_world_space_size - grid->cell_to_world_space_transform.z;
 
     return vec3(xoffset, yoffset, zoffset);
 }
 
-vec3 get_cell_world_space_center(Flood_Fill *ff, Cell *cell) {
-    return get_cell_world_space_center(ff, cell->position);
+vec3 get_cell_world_space_center(Flood_Fill *ff, v3i position) {
+    return get_cell_world_space_center(ff->grid, position);
 }
 
-void create_flood_fill(Flood_Fill *ff, World *world, Allocator *allocator, real cell_world_space_size) {
+void create_flood_fill(Flood_Fill *ff, Cell_Grid *grid, Allocator *allocator) {
     tmFunction(TM_FLOODING_COLOR);
 
-    ff->cell_world_space_size   = cell_world_space_size;
     ff->allocator               = allocator;
-    ff->world                   = world;
-    ff->frontier.allocator      = allocator;
+    ff->grid                    = grid;
+    ff->job_system              = null;
+    ff->worker_count            = 0;
+    ff->mutex                   = null;
+    ff->parent                  = null;
+    ff->jobs                    = null;
     ff->flooded_cells.allocator = allocator;
 
-    // Make sure that we have an uneven number of cells, so that the origin cell is actually centered on the
-    // world space center (with an even number of cells, an edge between two cells would be centered on the
-    // world space center).
-    ff->hx = ceil_to_uneven(world->half_size.x / ff->cell_world_space_size * 2.);
-    ff->hy = ceil_to_uneven(world->half_size.y / ff->cell_world_space_size * 2.);
-    ff->hz = ceil_to_uneven(world->half_size.z / ff->cell_world_space_size * 2.);
-    ff->cells = (Cell *) ff->allocator->allocate(ff->hx * ff->hy * ff->hz * sizeof(Cell));
-}
+    // :CellBricks
+    ff->cell_states = (u64 **) ff->allocator->allocate(grid->brick_count * sizeof(u64 *));
+    memset(ff->cell_states, 0, grid->brick_count * sizeof(u64 *));
+
+    //
+    // The flood fill is breadth-first, so the frontier is only ever a thin wave through the grid and never
+    // holds more cells than a few cross sections of it. Preallocate for that, so that the queue usually never
+    // has to grow while flooding.
+    //
+    s64 capacity_bound = min(2 * ((s64) grid->hx * grid->hy + (s64) grid->hy * grid->hz + (s64) grid->hx * grid->hz), grid->cell_count);
 
-void floodfill(Flood_Fill *ff, World *world, Allocator *allocator, vec3 flood_fill_origin, real cell_world_space_size) {
-    create_flood_fill(ff, world, allocator, cell_world_space_size);
-    floodfill(ff, flood_fill_origin);
-    destroy_flood_fill(ff);
+    ff->frontier.capacity = 16;
+    while(ff->frontier.capacity < capacity_bound) ff->frontier.capacity *= 2;
+    ff->frontier.data  = (Cell_Span *) ff->allocator->allocate(ff->frontier.capacity * sizeof(Cell_Span));
+    ff->frontier.head  = 0;
+    ff->frontier.count = 0;
 }
 
 void floodfill(Flood_Fill *ff, vec3 flood_fill_origin) {
-    tmFunction(TM_FLOODING_COLOR);
+    floodfill_from_cell(ff, find_origin_cell(ff->grid, flood_fill_origin));
+}
 
-    ff->frontier.clear();
+void destroy_flood_fill(Flood_Fill *ff) {
+    for(s64 i = 0; i < ff->grid->brick_count; ++i) {
+        if(ff->cell_states[i]) ff->allocator->deallocate(ff->cell_states[i]);
+    }
+
+    if(ff->jobs) {
+        for(s64 i = 0; i < ff->worker_count; ++i) {
+            ff->jobs[i].worker.flooded_cells.clear();
+            ff->allocator->deallocate(ff->jobs[i].worker.frontier.data);
+        }
+
+        ff->allocator->deallocate(ff->jobs);
+        ff->jobs = null;
+    }
+
+    ff->allocator->deallocate(ff->cell_states);
+    ff->allocator->deallocate(ff->frontier.data);
     ff->flooded_cells.clear();
-    memset(ff->cells, 0, ff->hx * ff->hy * ff->hz * sizeof(Cell));
-    
-    ff->world_to_cell_space_transform = vec3(fmod(flood_fill_origin.x, ff->cell_world_space_size), fmod(flood_fill_origin.y, ff->cell_world_space_size), fmod(flood_fill_origin.z, ff->cell_world_space_size));
-    
-    ff->cell_to_world_space_transform = vec3(ff->hx / 2, ff->hy / 2, ff->hz / 2) * ff->cell_world_space_size -
-        ff->world_to_cell_space_transform;
-    
-    ff->origin = world_space_to_cell_space(ff, flood_fill_origin);
-    definitely_add_cell_to_frontier(ff, ff->origin);
-    
-    while(ff->frontier.count) {
-        Cell *head = ff->frontier.pop_first(); // @@Speed: Pop last, that should be much more efficient. We don't care about order here, so that should not be a problem.
-        fill_cell(ff, head);
+    ff->cell_states       = null;
+    ff->frontier.data     = null;
+    ff->frontier.capacity = 0;
+    ff->frontier.count    = 0;
+    ff->grid  = null;
+}
+
+void create_flood_regions(Flood_Regions *regions, Cell_Grid *grid, Allocator *allocator) {
+    regions->allocator         = allocator;
+    regions->grid              = grid;
+    regions->regions.allocator = allocator;
+
+    // :CellBricks
+    regions->cell_regions = (u32 **) regions->allocator->allocate(grid->brick_count * sizeof(u32 *));
+    memset(regions->cell_regions, 0, grid->brick_count * sizeof(u32 *));
+}
+
+s64 find_or_flood_region(Flood_Regions *regions, Flood_Fill *ff, vec3 world_space_center) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    // :FloodRegions
+    v3i origin   = find_origin_cell(regions->grid, world_space_center);
+    s64 index    = get_cell_index(regions->grid, origin);
+    u32 *brick   = regions->cell_regions[index / CELLS_PER_BRICK];
+    if(brick && brick[index % CELLS_PER_BRICK]) return brick[index % CELLS_PER_BRICK] - 1;
+
+    floodfill_from_cell(ff, origin);
+
+    Flood_Region *region = regions->regions.push();
+    region->origin       = origin;
+    region->cells        = ff->flooded_cells.copy(regions->allocator);
+
+    u32 label = (u32) regions->regions.count;
+    for(u32 cell : ff->flooded_cells) {
+        brick = (u32 *) get_or_allocate_brick(regions->allocator, null, (void **) regions->cell_regions, cell / CELLS_PER_BRICK, CELLS_PER_BRICK * sizeof(u32));
+        brick[cell % CELLS_PER_BRICK] = label;
     }
+
+    return label - 1;
 }
 
-void destroy_flood_fill(Flood_Fill *ff) {
-    ff->allocator->deallocate(ff->cells);
-    ff->flooded_cells.clear();
-    ff->frontier.clear();
-    ff->cells = null;
-    ff->hx    = 0;
-    ff->hy    = 0;
-    ff->hz    = 0;
+void load_flood_region(Flood_Fill *ff, Flood_Region *region) {
+    tmFunction(TM_FLOODING_COLOR);
+
+    // Restore the state of the flood fill as if it had just flooded this region.
+    reset_flood_fill(ff);
+
+    ff->origin = region->origin;
+    ff->flooded_cells.reserve(region->cells.count);
+
+    for(u32 index : region->cells) {
+        set_cell_state(ff, index, CELL_Has_Been_Flooded);
+        ff->flooded_cells.add(index);
+    }
+}
+
+void destroy_flood_regions(Flood_Regions *regions) {
+    for(Flood_Region &region : regions->regions) region.cells.clear();
+    regions->regions.clear();
+
+    for(s64 i = 0; i < regions->grid->brick_count; ++i) {
+        if(regions->cell_regions[i]) regions->allocator->deallocate(regions->cell_regions[i]);
+    }
+
+    regions->allocator->deallocate(regions->cell_regions);
+    regions->cell_regions = null;
 }
@@ -8,6 +8,20 @@
 
 struct World;
 struct Allocator;
+struct Mutex;
+struct Job_System;
+struct BVH_Ray;
+struct Flood_Fill_Job;
+
+#define CELL_STATE_BITS      2
+#define CELLS_PER_STATE_WORD (64 / CELL_STATE_BITS)
+
+#define CELL_BRICK_ROW_SIZE  64 // The number of cells along the span axis in a brick, so that one row of a brick is exactly one u64 in a bitset.
+#define CELL_BRICK_SIZE      8  // The number of cells along the other two axes in a brick.
+#define CELL_BRICK_ROWS      (CELL_BRICK_SIZE * CELL_BRICK_SIZE)
+#define CELLS_PER_BRICK      (CELL_BRICK_ROW_SIZE * CELL_BRICK_ROWS)
+
+#define FLOOD_FILL_SPANS_PER_JOB 128 // The minimum number of frontier spans handled by one job when flooding in parallel (see :ParallelFlood).
 
 enum Cell_State {
     CELL_Untouched             = 0x0,
@@ -15,31 +29,137 @@ enum Cell_State {
     CELL_Has_Been_Flooded      = 0x2,
 };
 
-struct Cell {
-    v3i position; // So that we can just store pointers to Cells in the frontier, and don't have to also remember the position in the frontier...   Note: This will only be filled when it is first added to the frontier!
-    Cell_State state;
-};
-
-struct Flood_Fill {
+//
+// :CellEdgeMask
+// Whether the edge between two neighbouring cells is blocked by a delimiter (or the world bounds) only depends
+// on the world and the cell size, not on the anchor that is currently being flooded. The cell grid is therefore
+// aligned to the world (instead of the anchor) and shared by all flood fills, and the blocked edges are
+// calculated once per calculate_volumes by casting one ray along every edge. Every cell stores three bits, one
+// for the edge to its +X, +Y and +Z neighbour. The edge to the -X neighbour is the +X edge of that neighbour.
+//
+// :CellBricks
+// The cells are grouped into bricks of 64 x 8 x 8 cells (64 along the span axis), and the linear cell index
+// is brick-major, meaning that all cells of a brick are a consecutive range of indices. All per-cell data
+// (the blocked edges, the cell states and the region labels) only gets allocated brick by brick when it is
+// first written to, so that memory scales with the part of the world that is actually used instead of the
+// entire world. Bricks that were never written to just read as zero.
+//
+// :EdgeRayCulling
+// With USE_EDGE_RAY_CULLING, only bricks with a delimiter triangle (or the world bounds) close to them cast
+// edge rays. The BVH tells us which bricks have nothing nearby, and these skip their edge rays entirely,
+// since all of their edges must be unblocked. This only saves the edge rays: The flood fill, the assembler
+// and the marching cubes still work on every cell, so the results are exactly the same as without it.
+//
+struct Cell_Grid {
     Allocator *allocator;
+    Mutex *mutex; // Guards the allocation of bricks while the blocked edges are calculated by multiple threads. May be null.
     World *world;
 
     s32 hx, hy, hz; // Dimensions in cells
+    s64 cell_count; // The number of linear cell indices, including the cells of partial bricks outside the grid.
     real cell_world_space_size; // In world space
-    
+
+    // The longest axis of the grid is the innermost axis in a brick, so that a run of cells along it is also a
+    // run of bits in the bitsets (see :FloodSpans).
+    s64 span_axis;
+    s64 brick_sizes[AXIS_COUNT];      // The number of cells of a brick on each axis.
+    s64 local_strides[AXIS_COUNT];    // The difference in the linear index between two neighbouring cells inside of a brick.
+    s64 brick_dimensions[AXIS_COUNT]; // The number of bricks on each axis.
+    s64 brick_strides[AXIS_COUNT];    // The difference in the brick index between two neighbouring bricks.
+    s64 brick_count;
+
     vec3 cell_to_world_space_transform;
-    vec3 world_to_cell_space_transform;
+    u64 **blocked_edges; // Per brick, one bitset for each positive axis (AXIS_COUNT * CELL_BRICK_ROWS words). Null if no edge in the brick is blocked.
+};
+
+//
+// :FloodSpans
+// A run of neighbouring cells along the grid's span axis. With USE_SPANS_FOR_FLOOD_FILL, the flood fill
+// extends every cell it reaches into the longest untouched run along the span axis inside of its brick row,
+// and then handles that run as one unit. This means a lot fewer frontier operations, and the blocked edges
+// of the whole run can be read from one u64. Otherwise, every span is just a single cell.
+//
+struct Cell_Span {
+    u32 first; // The linear index of the first cell
+    u32 count;
+};
+
+//
+// The frontier of the flood fill. Popping from the front of a Resizable_Array would shift the entire array
+// every time, so this is a ring buffer of cell spans instead. Its capacity is always a power of two.
+//
+struct Cell_Queue {
+    Cell_Span *data;
+    s64 capacity;
+    s64 head;
+    s64 count;
+};
+
+//
+// :ParallelFlood
+// If a job system is set, the flood fill handles large frontiers level by level: The current frontier is
+// split between jobs, each of which floods its spans into its own frontier and flooded cells, and these get
+// merged again once all jobs are done. The jobs work on copies of the flood fill that share the cell states
+// of their parent. Cells are claimed atomically, so that every cell is only ever added to one frontier, and
+// new state bricks are allocated from the parent's allocator under the mutex. The copies are only created
+// the first time a frontier is large enough, and then reused for every level and every following flood.
+//
+struct Flood_Fill {
+    Allocator *allocator;
+    Cell_Grid *grid;
+
+    Job_System *job_system; // :ParallelFlood    May be null, in which case the flood fill is single-threaded.
+    s64 worker_count;       // The number of threads of the job system, which is also the number of jobs per level.
+    Mutex *mutex;           // Required if a job system is set.
+    Flood_Fill *parent;     // Only set for the copies used by the jobs.
+    Flood_Fill_Job *jobs;   // worker_count copies, allocated on the first parallel level and kept until destroy_flood_fill.
+
     v3i origin; // The first cell that was flooded (in cell coordinates)
 
-    Cell *cells;
-    Resizable_Array<Cell *> frontier;
-    Resizable_Array<Cell *> flooded_cells; // So that we can quickly iterate over all flooded cells in the assembler.
+    //
+    // The cells are only identified by their linear index into the grid (see get_cell_index), from which the
+    // position can be derived again. Every cell only stores its Cell_State in two bits, so that even small
+    // cell sizes don't require huge amounts of memory.
+    //
+    u64 **cell_states; // :CellBricks
+    Cell_Queue frontier;
+    Resizable_Array<u32> flooded_cells; // So that we can quickly iterate over all flooded cells in the assembler.
+};
+
+//
+// :FloodRegions
+// The region flooded from an anchor is exactly the connected component of the unblocked cell graph that
+// contains the anchor, so all anchors in the same room would flood the same cells. Every cell therefore gets
+// labelled with the region it belongs to when that region is first flooded, and all later anchors in it just
+// look up their region and share the result.
+//
+struct Flood_Region {
+    v3i origin;
+    Resizable_Array<u32> cells; // The cells of this region, in the order in which they were flooded.
 };
 
-Cell *get_cell(Flood_Fill *ff, v3i position);
+struct Flood_Regions {
+    Allocator *allocator;
+    Cell_Grid *grid;
+
+    u32 **cell_regions; // :CellBricks One plus the index of the region that contains a cell, zero for cells that haven't been labelled yet.
+    Resizable_Array<Flood_Region> regions;
+};
+
+void create_cell_grid(Cell_Grid *grid, World *world, Allocator *allocator, real cell_world_space_size);
+void calculate_blocked_cell_edges(Cell_Grid *grid, s64 first_brick, s64 last_brick, Resizable_Array<BVH_Ray> *recorded_rays = null);
+void destroy_cell_grid(Cell_Grid *grid);
+
+s64 get_cell_index(Cell_Grid *grid, v3i position);
+v3i get_cell_position(Cell_Grid *grid, s64 index);
+Cell_State get_cell_state(Flood_Fill *ff, v3i position);
+vec3 get_cell_world_space_center(Cell_Grid *grid, v3i position);
 vec3 get_cell_world_space_center(Flood_Fill *ff, v3i position);
-vec3 get_cell_world_space_center(Flood_Fill *ff, Cell *cell);
-void create_flood_fill(Flood_Fill *ff, World *world, Allocator *allocator, real cell_world_space_size);
-void floodfill(Flood_Fill *ff, World *world, Allocator *allocator, vec3 world_space_center, real cell_world_space_size);
+void create_flood_fill(Flood_Fill *ff, Cell_Grid *grid, Allocator *allocator);
 void floodfill(Flood_Fill *ff, vec3 world_space_center);
 void destroy_flood_fill(Flood_Fill *ff);
+
+void create_flood_regions(Flood_Regions *regions, Cell_Grid *grid, Allocator *allocator);
+s64 find_or_flood_region(Flood_Regions *regions, Flood_Fill *ff, vec3 world_space_center);
+void load_flood_region(Flood_Fill *ff, Flood_Region *region);
+void destroy_flood_regions(Flood_Regions *regions);
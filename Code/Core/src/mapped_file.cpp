@@ -0,0 +1,110 @@
+#include "mapped_file.h"
+
+#include <stdio.h>
+
+#if FOUNDATION_WIN32
+# define WIN32_LEAN_AND_MEAN
+# define NOMINMAX
+# include <Windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#define MAX_MAPPED_FILE_PATH 1024
+
+static
+b8 file_path_to_cstring(string file_path, char *buffer) {
+    if(file_path.count >= MAX_MAPPED_FILE_PATH) return false;
+    memcpy(buffer, file_path.data, file_path.count);
+    buffer[file_path.count] = 0;
+    return true;
+}
+
+b8 map_file(Mapped_File *file, string file_path) {
+    file->data                = null;
+    file->size                = 0;
+    file->platform_handles[0] = null;
+    file->platform_handles[1] = null;
+
+    char cstring[MAX_MAPPED_FILE_PATH];
+    if(!file_path_to_cstring(file_path, cstring)) return false;
+
+#if FOUNDATION_WIN32
+    HANDLE file_handle = CreateFileA(cstring, GENERIC_READ, FILE_SHARE_READ, null, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+    if(file_handle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file_handle);
+        return false;
+    }
+
+    HANDLE mapping_handle = CreateFileMappingA(file_handle, null, PAGE_READONLY, 0, 0, null);
+    if(!mapping_handle) {
+        CloseHandle(file_handle);
+        return false;
+    }
+
+    void *data = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if(!data) {
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        return false;
+    }
+
+    file->data                = data;
+    file->size                = file_size.QuadPart;
+    file->platform_handles[0] = file_handle;
+    file->platform_handles[1] = mapping_handle;
+#else
+    int descriptor = open(cstring, O_RDONLY);
+    if(descriptor < 0) return false;
+
+    struct stat status;
+    if(fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        close(descriptor);
+        return false;
+    }
+
+    void *data = mmap(null, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor); // The mapping keeps the file alive.
+    if(data == MAP_FAILED) return false;
+
+    file->data = data;
+    file->size = status.st_size;
+#endif
+
+    return true;
+}
+
+void unmap_file(Mapped_File *file) {
+    if(!file->data) return;
+
+#if FOUNDATION_WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle((HANDLE) file->platform_handles[1]);
+    CloseHandle((HANDLE) file->platform_handles[0]);
+#else
+    munmap((void *) file->data, file->size);
+#endif
+
+    file->data                = null;
+    file->size                = 0;
+    file->platform_handles[0] = null;
+    file->platform_handles[1] = null;
+}
+
+b8 write_entire_file(string file_path, const void *data, s64 size) {
+    char cstring[MAX_MAPPED_FILE_PATH];
+    if(!file_path_to_cstring(file_path, cstring)) return false;
+
+    FILE *handle = fopen(cstring, "wb");
+    if(!handle) return false;
+
+    b8 success = fwrite(data, 1, size, handle) == (size_t) size;
+    fclose(handle);
+    return success;
+}
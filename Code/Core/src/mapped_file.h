@@ -0,0 +1,19 @@
+#pragma once
+
+#include "foundation.h"
+#include "string_type.h"
+
+//
+// A read-only view of an entire file, mapped into memory by the OS, so that the pages only get loaded once
+// they are actually touched (and can be shared between processes). Used for the BVH cache, see
+// World::map_bvh_cache.
+//
+struct Mapped_File {
+    const void *data;
+    s64 size;
+    void *platform_handles[2]; // The file and mapping handles on windows, unused elsewhere.
+};
+
+b8 map_file(Mapped_File *file, string file_path);
+void unmap_file(Mapped_File *file);
+b8 write_entire_file(string file_path, const void *data, s64 size);
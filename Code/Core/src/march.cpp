@@ -277,8 +277,7 @@ static const s8 triangulation_lookup_table[256][16] = {
 
 static
 b8 test_position(Flood_Fill *ff, v3i position) {
-    Cell *cell = get_cell(ff, position);
-    return cell != null && cell->state & CELL_Has_Been_Flooded; // cell is null when out of bounds
+    return get_cell_state(ff, position) == CELL_Has_Been_Flooded; // Cells out of bounds are always untouched
 }
 
 static
@@ -335,9 +334,9 @@ void marching_cubes(Resizable_Array<Triangle> *output, Flood_Fill *ff) {
     tmFunction(TM_MARCHING_COLOR);
 
     // The position we are iterating over here is the (-x, -y, -z) corner of the cube.
-    for(s32 x = -1; x < ff->hx; ++x) {
-		for(s32 y = -1; y < ff->hy; ++y) {
-			for(s32 z = -1; z < ff->hz; ++z) {
+    for(s32 x = -1; x < ff->grid->hx; ++x) {
+		for(s32 y = -1; y < ff->grid->hy; ++y) {
+			for(s32 z = -1; z < ff->grid->hz; ++z) {
 				visit(output, ff, v3i(x, y, z));
 			}
 		}
@@ -1,4 +1,4 @@
-void setup_world() {
+World_Handle setup_world() {
     World_Handle world = core_create_world(14.203, 3.139951, 22.02436);
     core_add_anchor(world, -10.78964, 0, 4.96275);
     core_add_anchor(world, -8.111296, 0, 3.39205);
@@ -831,4 +831,5 @@ void setup_world() {
     core_add_delimiter_plane(world, d329, AXIS_POSITIVE_X, false, VIRTUAL_EXTENSION_U);
     core_add_delimiter_plane(world, d329, AXIS_NEGATIVE_X, false, VIRTUAL_EXTENSION_U);
     core_calculate_volumes(world, 1);
+    return world;
 }
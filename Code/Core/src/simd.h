@@ -0,0 +1,112 @@
+#pragma once
+
+#include "foundation.h"
+#include "typedefs.h"
+
+//
+// A tiny abstraction over four 'real' lanes, so that the BVH can test multiple children (or triangles)
+// against a ray at once. Depending on the precision and the instruction set we compile for, this maps onto a
+// single SSE register (f32), a single AVX register (f64), two SSE2 registers (f64) or plain scalar code.
+//
+// Note: Just like the x86 min / max instructions, real4_min and real4_max return the second operand if
+// either operand is NaN. We rely on this to ignore NaNs in the slab tests, by always passing the running
+// accumulator as the second operand.
+//
+
+#if defined(__AVX__)
+# define CORE_SIMD_AVX true
+#else
+# define CORE_SIMD_AVX false
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define CORE_SIMD_SSE true
+#else
+# define CORE_SIMD_SSE false
+#endif
+
+#if CORE_SIMD_SSE || CORE_SIMD_AVX
+# include <immintrin.h>
+#endif
+
+#define REAL4_LANES 4
+
+
+
+#if CORE_SINGLE_PRECISION && CORE_SIMD_SSE
+/* ------------------------------------------------ SSE, f32 ------------------------------------------------ */
+
+struct real4 {
+    __m128 v;
+};
+
+static inline real4 real4_load(const real *pointer)     { return { _mm_loadu_ps(pointer) }; }
+static inline real4 real4_load_f32(const f32 *pointer) { return { _mm_loadu_ps(pointer) }; }
+static inline void real4_store(real *pointer, real4 a)  { _mm_storeu_ps(pointer, a.v); }
+static inline real4 real4_broadcast(real value)         { return { _mm_set1_ps(value) }; }
+static inline real4 real4_add(real4 a, real4 b)         { return { _mm_add_ps(a.v, b.v) }; }
+static inline real4 real4_sub(real4 a, real4 b)         { return { _mm_sub_ps(a.v, b.v) }; }
+static inline real4 real4_mul(real4 a, real4 b)         { return { _mm_mul_ps(a.v, b.v) }; }
+static inline real4 real4_div(real4 a, real4 b)         { return { _mm_div_ps(a.v, b.v) }; }
+static inline real4 real4_min(real4 a, real4 b)         { return { _mm_min_ps(a.v, b.v) }; }
+static inline real4 real4_max(real4 a, real4 b)         { return { _mm_max_ps(a.v, b.v) }; }
+static inline u32 real4_less_equal(real4 a, real4 b)    { return (u32) _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+
+#elif !CORE_SINGLE_PRECISION && CORE_SIMD_AVX
+/* ------------------------------------------------ AVX, f64 ------------------------------------------------ */
+
+struct real4 {
+    __m256d v;
+};
+
+static inline real4 real4_load(const real *pointer)     { return { _mm256_loadu_pd(pointer) }; }
+static inline real4 real4_load_f32(const f32 *pointer) { return { _mm256_cvtps_pd(_mm_loadu_ps(pointer)) }; }
+static inline void real4_store(real *pointer, real4 a)  { _mm256_storeu_pd(pointer, a.v); }
+static inline real4 real4_broadcast(real value)         { return { _mm256_set1_pd(value) }; }
+static inline real4 real4_add(real4 a, real4 b)         { return { _mm256_add_pd(a.v, b.v) }; }
+static inline real4 real4_sub(real4 a, real4 b)         { return { _mm256_sub_pd(a.v, b.v) }; }
+static inline real4 real4_mul(real4 a, real4 b)         { return { _mm256_mul_pd(a.v, b.v) }; }
+static inline real4 real4_div(real4 a, real4 b)         { return { _mm256_div_pd(a.v, b.v) }; }
+static inline real4 real4_min(real4 a, real4 b)         { return { _mm256_min_pd(a.v, b.v) }; }
+static inline real4 real4_max(real4 a, real4 b)         { return { _mm256_max_pd(a.v, b.v) }; }
+static inline u32 real4_less_equal(real4 a, real4 b)    { return (u32) _mm256_movemask_pd(_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ)); }
+
+#elif !CORE_SINGLE_PRECISION && CORE_SIMD_SSE
+/* ----------------------------------------------- SSE2, f64 ----------------------------------------------- */
+
+struct real4 {
+    __m128d lo, hi;
+};
+
+static inline real4 real4_load(const real *pointer)     { return { _mm_loadu_pd(pointer), _mm_loadu_pd(pointer + 2) }; }
+static inline real4 real4_load_f32(const f32 *pointer) { __m128 v = _mm_loadu_ps(pointer); return { _mm_cvtps_pd(v), _mm_cvtps_pd(_mm_movehl_ps(v, v)) }; }
+static inline void real4_store(real *pointer, real4 a)  { _mm_storeu_pd(pointer, a.lo); _mm_storeu_pd(pointer + 2, a.hi); }
+static inline real4 real4_broadcast(real value)         { return { _mm_set1_pd(value), _mm_set1_pd(value) }; }
+static inline real4 real4_add(real4 a, real4 b)         { return { _mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi) }; }
+static inline real4 real4_sub(real4 a, real4 b)         { return { _mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi) }; }
+static inline real4 real4_mul(real4 a, real4 b)         { return { _mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi) }; }
+static inline real4 real4_div(real4 a, real4 b)         { return { _mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi) }; }
+static inline real4 real4_min(real4 a, real4 b)         { return { _mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi) }; }
+static inline real4 real4_max(real4 a, real4 b)         { return { _mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi) }; }
+static inline u32 real4_less_equal(real4 a, real4 b)    { return (u32) (_mm_movemask_pd(_mm_cmple_pd(a.lo, b.lo)) | (_mm_movemask_pd(_mm_cmple_pd(a.hi, b.hi)) << 2)); }
+
+#else
+/* ------------------------------------------------- Scalar ------------------------------------------------- */
+
+struct real4 {
+    real v[REAL4_LANES];
+};
+
+static inline real4 real4_load(const real *pointer)     { return { pointer[0], pointer[1], pointer[2], pointer[3] }; }
+static inline real4 real4_load_f32(const f32 *pointer) { return { (real) pointer[0], (real) pointer[1], (real) pointer[2], (real) pointer[3] }; }
+static inline void real4_store(real *pointer, real4 a)  { pointer[0] = a.v[0]; pointer[1] = a.v[1]; pointer[2] = a.v[2]; pointer[3] = a.v[3]; }
+static inline real4 real4_broadcast(real value)         { return { value, value, value, value }; }
+static inline real4 real4_add(real4 a, real4 b)         { return { a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3] }; }
+static inline real4 real4_sub(real4 a, real4 b)         { return { a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3] }; }
+static inline real4 real4_mul(real4 a, real4 b)         { return { a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3] }; }
+static inline real4 real4_div(real4 a, real4 b)         { return { a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3] }; }
+static inline real4 real4_min(real4 a, real4 b)         { return { a.v[0] < b.v[0] ? a.v[0] : b.v[0], a.v[1] < b.v[1] ? a.v[1] : b.v[1], a.v[2] < b.v[2] ? a.v[2] : b.v[2], a.v[3] < b.v[3] ? a.v[3] : b.v[3] }; }
+static inline real4 real4_max(real4 a, real4 b)         { return { a.v[0] > b.v[0] ? a.v[0] : b.v[0], a.v[1] > b.v[1] ? a.v[1] : b.v[1], a.v[2] > b.v[2] ? a.v[2] : b.v[2], a.v[3] > b.v[3] ? a.v[3] : b.v[3] }; }
+static inline u32 real4_less_equal(real4 a, real4 b)    { return (a.v[0] <= b.v[0]) << 0 | (a.v[1] <= b.v[1]) << 1 | (a.v[2] <= b.v[2]) << 2 | (a.v[3] <= b.v[3]) << 3; }
+
+#endif
@@ -7,11 +7,16 @@
 #include "memutils.h"
 
 #define USE_BVH_FOR_RAYCASTS           true
+#define USE_SAH_FOR_BVH                true
+#define USE_SPATIAL_SPLITS_FOR_BVH     true
+#define USE_WIDE_BVH                   true
 #define USE_MARCHING_CUBES_FOR_VOLUMES false
 #define USE_JOB_SYSTEM                 true
 #define USE_HASH_TABLE_IN_ASSEMBLER    false
 #define USE_ART_IN_ASSEMBLER           true
 #define USE_OPTIMIZER_FOR_DELIMITERS   true
+#define USE_SPANS_FOR_FLOOD_FILL       true
+#define USE_EDGE_RAY_CULLING           true
 
 //
 // This algorithm is supposed to work with both single and double floating point precision, so that the usual
@@ -233,13 +233,30 @@ b8 point_inside_volume(Resizable_Array<Triangle> &triangles, vec3 point) {
 
 
 
+/* --------------------------------------------- Cell Edge Job --------------------------------------------- */
+
+struct Cell_Edge_Job {
+    Cell_Grid *grid;
+    s64 first;
+    s64 last;
+};
+
+static
+void cell_edge_job(Cell_Edge_Job *job) {
+    tmFunction(TM_WORLD_COLOR);
+    calculate_blocked_cell_edges(job->grid, job->first, job->last);
+}
+
+
+
 /* ------------------------------------------ Volume Calculation Job ------------------------------------------ */
 
 struct Volume_Calculation_Job {
     World *world;
-    s64 first;
-    s64 last;
-    real cell_world_space_size;
+    Flood_Region *region;
+    s64 slice;       // :AssemblySlices The slice of the candidate triangles which this job assembles.
+    s64 slice_count; // :AssemblySlices The number of jobs sharing this region.
+    Resizable_Array<Triangle> volume; // The part of the region's volume found by this job, on the world allocator.
 };
 
 static
@@ -247,27 +264,24 @@ void volume_calculation_job(Volume_Calculation_Job *job) {
     tmFunction(TM_WORLD_COLOR);
     
     Flood_Fill ff;
-    create_flood_fill(&ff, job->world, &temp, job->cell_world_space_size);
-
-    for(s64 i = job->first; i <= job->last; ++i) {
-        Anchor &anchor = job->world->anchors[i];
-        floodfill(&ff, anchor.position);
+    create_flood_fill(&ff, &job->world->cell_grid, &temp);
+    load_flood_region(&ff, job->region);
 
 #if USE_MARCHING_CUBES_FOR_VOLUMES
-        marching_cubes(&anchor.volume, &ff);
+    Resizable_Array<Triangle> temp_volume;
+    temp_volume.allocator = &temp;
+    marching_cubes(&temp_volume, &ff);
 #else
+    auto temp_volume = assemble(job->world, &ff, &temp, job->slice, job->slice_count);
+#endif
 
 #if USE_JOB_SYSTEM
-        auto temp_volume = assemble(job->world, &ff, &temp);
-
-        lock(&job->world->mutex);
-        anchor.volume = temp_volume.copy(job->world->allocator);
-        unlock(&job->world->mutex);
+    lock(&job->world->mutex);
+    job->volume = temp_volume.copy(job->world->allocator);
+    unlock(&job->world->mutex);
 #else
-        anchor.volume = assemble(job->world, &ff, job->world->allocator);
-#endif
+    job->volume = temp_volume.copy(job->world->allocator);
 #endif
-    }
 
     destroy_flood_fill(&ff);
 }
@@ -293,9 +307,16 @@ void World::create(vec3 half_size) {
     // Set up the basic objects.
     //
     this->half_size                  = half_size;
+    this->cell_world_space_size      = 0.;
     this->anchors.allocator          = this->allocator;
     this->delimiters.allocator       = this->allocator;
     this->root_bvh_entries.allocator = this->allocator;
+    this->bvh_cache_file_path.count  = 0;
+    this->bvh_cache_file_path.data   = null;
+    this->bvh_cache_file.data        = null;
+    this->bvh_cache_file.size        = 0;
+    this->bvh_cache_owners           = null;
+    this->cell_grid.cell_count       = 0;
     
     //
     // Create the clipping planes.
@@ -316,6 +337,8 @@ void World::create(vec3 half_size) {
 }
 
 void World::destroy() {
+    unmap_file(&this->bvh_cache_file);
+    this->free_bvh_cache_owners();
     this->arena.destroy();
 }
 
@@ -404,10 +427,77 @@ void World::add_both_delimiter_planes(Delimiter *delimiter, Axis_Index normal_ax
     this->add_delimiter_plane(delimiter, (Axis_Index) (normal_axis + AXIS_COUNT), false, virtual_extension);
 }
 
+void World::move_delimiter(Delimiter *delimiter, vec3 position, quat rotation) {
+    tmFunction(TM_WORLD_COLOR);
+
+    //
+    // Rigidly moves the (already clipped) planes of this delimiter, and patches the BVH instead of rebuilding
+    // it, so that an editor can cheaply preview a moved delimiter. The clipping against the other delimiters
+    // is only redone by the next calculate_volumes.
+    //
+    vec3 old_position = delimiter->position;
+    vec3 old_unit_axes[AXIS_COUNT] = { delimiter->local_unit_axes[AXIS_X], delimiter->local_unit_axes[AXIS_Y], delimiter->local_unit_axes[AXIS_Z] };
+
+    vec3 half_size = delimiter->dbg_half_size;
+    delimiter->position                  = position;
+    delimiter->local_scaled_axes[AXIS_X] = qt_rotate(rotation, vec3(half_size.x, 0, 0));
+    delimiter->local_scaled_axes[AXIS_Y] = qt_rotate(rotation, vec3(0, half_size.y, 0));
+    delimiter->local_scaled_axes[AXIS_Z] = qt_rotate(rotation, vec3(0, 0, half_size.z));
+    delimiter->local_unit_axes[AXIS_X]   = qt_rotate(rotation, vec3(1, 0, 0));
+    delimiter->local_unit_axes[AXIS_Y]   = qt_rotate(rotation, vec3(0, 1, 0));
+    delimiter->local_unit_axes[AXIS_Z]   = qt_rotate(rotation, vec3(0, 0, 1));
+    delimiter->dbg_rotation              = rotation;
+
+    // Express every point in the old local frame of the delimiter, and then move it into the new one.
+    auto transform_direction = [&](vec3 direction) -> vec3 {
+        return delimiter->local_unit_axes[AXIS_X] * v3_dot_v3(direction, old_unit_axes[AXIS_X]) +
+               delimiter->local_unit_axes[AXIS_Y] * v3_dot_v3(direction, old_unit_axes[AXIS_Y]) +
+               delimiter->local_unit_axes[AXIS_Z] * v3_dot_v3(direction, old_unit_axes[AXIS_Z]);
+    };
+
+    auto transform_point = [&](vec3 point) -> vec3 { return position + transform_direction(point - old_position); };
+
+    for(s64 i = 0; i < delimiter->plane_count; ++i) {
+        Triangulated_Plane *plane = &delimiter->planes[i];
+        plane->o = transform_point(plane->o);
+        plane->n = transform_direction(plane->n);
+
+        for(Triangle &triangle : plane->triangles) {
+            triangle.p0 = transform_point(triangle.p0);
+            triangle.p1 = transform_point(triangle.p1);
+            triangle.p2 = transform_point(triangle.p2);
+        }
+
+        // The BVH only exists once the volumes have been calculated.
+        if(this->bvh.nodes.count) this->update_delimiter_plane_in_bvh(plane);
+    }
+}
+
+void World::set_bvh_cache(string file_path) {
+    if(this->bvh_cache_file_path.count) deallocate_string(this->allocator, &this->bvh_cache_file_path);
+    this->bvh_cache_file_path = copy_string(this->allocator, file_path);
+}
+
 void World::calculate_volumes(real cell_world_space_size) {
+#if USE_JOB_SYSTEM
+    // Create the job system. This is shared between building the BVH and building the anchor volumes.
+    create_mutex(&this->mutex);
+    this->worker_count = os_get_number_of_hardware_threads();
+    create_job_system(&this->job_system, this->worker_count);
+#endif
+
+    this->cell_world_space_size = cell_world_space_size;
+
     this->clip_delimiters();
     this->create_bvh();
-    this->build_anchor_volumes(cell_world_space_size);
+    this->build_cell_grid(cell_world_space_size);
+    this->build_anchor_volumes();
+
+#if USE_JOB_SYSTEM
+    // Destroy the job system.
+    destroy_job_system(&this->job_system, JOB_SYSTEM_Kill_Workers);
+    destroy_mutex(&this->mutex);
+#endif
 }
 
 Anchor *World::query(vec3 point) {
@@ -426,24 +516,144 @@ Anchor *World::query(vec3 point) {
 void World::create_bvh() {
     tmFunction(TM_WORLD_COLOR);
 
-    this->bvh.create(this->allocator);
+    this->bvh.create(this->allocator, USE_SAH_FOR_BVH ? (USE_SPATIAL_SPLITS_FOR_BVH ? BVH_SPLIT_Spatial_SAH : BVH_SPLIT_Binned_SAH) : BVH_SPLIT_Midpoint);
     
     for(Delimiter &delimiter : this->delimiters) {
         for(s64 i = 0; i < delimiter.plane_count; ++i) {
             Triangulated_Plane &plane = delimiter.planes[i];
             for(Triangle &triangle : plane.triangles) {
-                this->bvh.add(triangle);
+                this->bvh.add(triangle, &plane);
             }
         }
     }
+
+    // :BVHCache
+    if(!this->map_bvh_cache()) {
+        // The top-down builders get slow on huge scenes, where the linear builder is the better trade-off.
+        if(this->bvh.entries.count >= BVH_MORTON_MIN_ENTRIES) this->bvh.split_method = BVH_SPLIT_Morton;
     
-    this->bvh.subdivide();
-    //this->bvh.print_stats();
+#if USE_JOB_SYSTEM
+        this->bvh.subdivide(&this->job_system);
+#else
+        this->bvh.subdivide();
+#endif
+        //this->bvh.print_stats();
+
+        this->write_bvh_cache();
+    }
+
+    this->build_root_face_indices();
+}
+
+static
+u64 get_delimiter_plane_id(void *owner, void *user_data) {
+    World *world = (World *) user_data;
+    Triangulated_Plane *plane = (Triangulated_Plane *) owner;
+
+    s64 delimiter_index = ((u8 *) plane - (u8 *) world->delimiters.data) / sizeof(Delimiter);
+    s64 plane_index     = plane - world->delimiters[delimiter_index].planes;
+    return delimiter_index * ARRAY_COUNT(world->delimiters[delimiter_index].planes) + plane_index;
+}
+
+b8 World::map_bvh_cache() {
+    // The BVH no longer references a previously mapped file or its owners, since it has been re-created.
+    unmap_file(&this->bvh_cache_file);
+    this->free_bvh_cache_owners();
+
+    if(!this->bvh_cache_file_path.count) return false;
+
+    tmFunction(TM_WORLD_COLOR);
+
+    if(!map_file(&this->bvh_cache_file, this->bvh_cache_file_path)) return false;
+
+    //
+    // The cache is only valid if the clipped delimiter triangles and their owning planes are exactly the ones
+    // the cached BVH was built from. The remaining validation (version, layout, bounds) is done by the BVH itself.
+    //
+    const BVH_Blob_Header *header = (const BVH_Blob_Header *) this->bvh_cache_file.data;
+    if(this->bvh_cache_file.size < (s64) sizeof(BVH_Blob_Header) || header->content_hash != this->bvh.hash_entries(get_delimiter_plane_id, this)) {
+        unmap_file(&this->bvh_cache_file);
+        return false;
+    }
+
+    s64 planes_per_delimiter = ARRAY_COUNT(Delimiter::planes);
+    s64 owner_count = this->delimiters.count * planes_per_delimiter;
+    this->bvh_cache_owners = (void **) this->allocator->allocate(owner_count * sizeof(void *));
 
+    for(s64 i = 0; i < this->delimiters.count; ++i) {
+        for(s64 j = 0; j < planes_per_delimiter; ++j) {
+            this->bvh_cache_owners[i * planes_per_delimiter + j] = &this->delimiters[i].planes[j];
+        }
+    }
+
+    if(!this->bvh.map_blob(this->bvh_cache_file.data, this->bvh_cache_file.size, this->bvh_cache_owners, owner_count)) {
+        unmap_file(&this->bvh_cache_file);
+        this->free_bvh_cache_owners();
+        return false;
+    }
+
+    return true;
+}
+
+void World::free_bvh_cache_owners() {
+    if(!this->bvh_cache_owners) return;
+
+    this->allocator->deallocate(this->bvh_cache_owners);
+    this->bvh_cache_owners = null;
+}
+
+void World::write_bvh_cache() {
+    if(!this->bvh_cache_file_path.count) return;
+
+    tmFunction(TM_WORLD_COLOR);
+
+    s64 blob_size = this->bvh.get_blob_size();
+    void *blob = Default_Allocator->allocate(blob_size);
+    this->bvh.write_blob(blob, blob_size, get_delimiter_plane_id, this);
+
+    if(!write_entire_file(this->bvh_cache_file_path, blob, blob_size)) {
+        printf("Failed to write the BVH cache file '%.*s'.\n", (u32) this->bvh_cache_file_path.count, this->bvh_cache_file_path.data);
+    }
+
+    Default_Allocator->deallocate(blob);
+}
+
+void World::build_root_face_indices() {
+    tmFunction(TM_WORLD_COLOR);
+
+    //
     // :RootPlanesBVH
-    for(Triangulated_Plane &root_plane : this->root_clipping_planes) {
-        for(Triangle &all : root_plane.triangles) {
-            this->root_bvh_entries.add({ all, all.center() });
+    // Counting sort of the root triangles by face and tile, so that the triangles of each tile end up next to
+    // each other in the root_bvh_entries.
+    //
+    this->root_bvh_entries.clear();
+
+    for(s64 face = 0; face < ARRAY_COUNT(this->root_clipping_planes); ++face) {
+        Triangulated_Plane *root_plane = &this->root_clipping_planes[face];
+        Root_Face_Index *index = &this->root_face_indices[face];
+        index->u_axis = (face / 2 + 1) % AXIS_COUNT;
+        index->v_axis = (face / 2 + 2) % AXIS_COUNT;
+
+        const s64 tile_count = ROOT_FACE_GRID_SIZE * ROOT_FACE_GRID_SIZE;
+
+        for(s64 i = 0; i <= tile_count; ++i) index->tile_offsets[i] = 0;
+
+        for(Triangle &triangle : root_plane->triangles) {
+            ++index->tile_offsets[this->get_root_face_tile(face, triangle.center()) + 1];
+        }
+
+        index->tile_offsets[0] = (u32) this->root_bvh_entries.count;
+        for(s64 i = 0; i < tile_count; ++i) index->tile_offsets[i + 1] += index->tile_offsets[i];
+
+        u32 cursors[ROOT_FACE_GRID_SIZE * ROOT_FACE_GRID_SIZE];
+        for(s64 i = 0; i < tile_count; ++i) cursors[i] = index->tile_offsets[i];
+
+        this->root_bvh_entries.reserve(this->root_bvh_entries.count + root_plane->triangles.count);
+        this->root_bvh_entries.count += root_plane->triangles.count;
+
+        for(Triangle &triangle : root_plane->triangles) {
+            vec3 center = triangle.center();
+            this->root_bvh_entries[cursors[this->get_root_face_tile(face, center)]++] = { triangle, root_plane, center, false };
         }
     }
 }
@@ -451,13 +661,25 @@ void World::create_bvh() {
 void World::create_bvh_from_triangles(Resizable_Array<Triangle> &triangles) {
     tmFunction(TM_WORLD_COLOR);
 
-    this->bvh.create(this->allocator);
+    this->bvh.create(this->allocator, USE_SAH_FOR_BVH ? (USE_SPATIAL_SPLITS_FOR_BVH ? BVH_SPLIT_Spatial_SAH : BVH_SPLIT_Binned_SAH) : BVH_SPLIT_Midpoint);
 
     for(Triangle &triangle : triangles) this->bvh.add(triangle);
     
     this->bvh.subdivide();
 }
 
+void World::update_delimiter_plane_in_bvh(Triangulated_Plane *plane) {
+    tmFunction(TM_WORLD_COLOR);
+
+    //
+    // Called after the triangles of a delimiter plane have changed (e.g. because a delimiter was moved in an
+    // editor). This is a lot cheaper than rebuilding the BVH through create_bvh, but the tree quality slowly
+    // degrades with every update, so a full rebuild is still a good idea every now and then.
+    //
+    this->bvh.remove(plane);
+    this->bvh.insert(plane->triangles, plane);
+}
+
 void World::clip_delimiters() {
     tmFunction(TM_WORLD_COLOR);
 
@@ -551,54 +773,158 @@ void World::clip_delimiters() {
     release_temp_allocator(temp_mark);
 }
 
-void World::build_anchor_volumes(real cell_world_space_size) {
+void World::build_cell_grid(real cell_world_space_size) {
     tmFunction(TM_WORLD_COLOR);
 
-    u64 temp_mark = mark_temp_allocator();
+    // :CellEdgeMask
+    if(this->cell_grid.cell_count) destroy_cell_grid(&this->cell_grid);
+    create_cell_grid(&this->cell_grid, this, this->allocator, cell_world_space_size);
 
 #if USE_JOB_SYSTEM
-    // Create the job system.
-    create_mutex(&this->mutex);
-    create_job_system(&this->job_system, os_get_number_of_hardware_threads());
+    //
+    // :CellBricks
+    // Split the grid into ranges of whole bricks, so that no two jobs ever write into the same brick. The
+    // bricks get allocated on first write though, which goes through the shared world allocator.
+    // There are a lot more bricks than threads, so just spawn a few jobs per thread to balance out the empty
+    // parts of the world against the ones with a lot of delimiters.
+    //
+    this->cell_grid.mutex = &this->mutex;
+
+    u64 temp_mark = mark_temp_allocator();
 
-    // Set up the different jobs. Each anchor takes so long to calculate that it's probably worth it making
-    // every single one a single job.
-    s64 job_count = this->anchors.count;
-    Volume_Calculation_Job *jobs = (Volume_Calculation_Job *) this->allocator->allocate(job_count * sizeof(Volume_Calculation_Job));
+    s64 brick_count     = this->cell_grid.brick_count;
+    s64 job_count       = min(brick_count, this->worker_count * 4);
+    s64 bricks_per_job  = (brick_count + job_count - 1) / job_count;
+    Cell_Edge_Job *jobs = (Cell_Edge_Job *) temp.allocate(job_count * sizeof(Cell_Edge_Job));
 
-    s64 prev_last = -1;
     for(s64 i = 0; i < job_count; ++i) {
-        s64 first = prev_last + 1;
-        s64 last  = (i + 1 == job_count) ? (this->anchors.count - 1) : first + (this->anchors.count / job_count) - 1;
-        jobs[i].world = this;
-        jobs[i].first = first;
-        jobs[i].last  = last;
-        jobs[i].cell_world_space_size = cell_world_space_size;
-        prev_last = last;
+        jobs[i].grid  = &this->cell_grid;
+        jobs[i].first = i * bricks_per_job;
+        jobs[i].last  = min((i + 1) * bricks_per_job, brick_count) - 1;
+        if(jobs[i].first <= jobs[i].last) spawn_job(&this->job_system, { (Job_Procedure) cell_edge_job, &jobs[i] });
+    }
+
+    wait_for_all_jobs(&this->job_system);
 
+    release_temp_allocator(temp_mark);
+
+    // The rest of the volume calculation only reads the bricks.
+    this->cell_grid.mutex = null;
+#else
+    calculate_blocked_cell_edges(&this->cell_grid, 0, this->cell_grid.brick_count - 1);
+#endif
+}
+
+void World::build_anchor_volumes() {
+    tmFunction(TM_WORLD_COLOR);
+
+    u64 temp_mark = mark_temp_allocator();
+
+    //
+    // :FloodRegions
+    // Figure out the region of every anchor first, so that every region only gets flooded and assembled once.
+    // The regions are flooded one after the other, but a large region spreads its frontier over the job
+    // system (see :ParallelFlood).
+    //
+    Flood_Regions regions;
+    create_flood_regions(&regions, &this->cell_grid, this->allocator);
+
+    s64 *anchor_regions = (s64 *) this->allocator->allocate(this->anchors.count * sizeof(s64));
+
+    {
+        Flood_Fill ff;
+        create_flood_fill(&ff, &this->cell_grid, this->allocator);
+
+#if USE_JOB_SYSTEM
+        ff.job_system   = &this->job_system;
+        ff.worker_count = this->worker_count;
+        ff.mutex        = &this->mutex;
+#endif
+
+        for(Anchor &anchor : this->anchors) {
+            anchor_regions[anchor.id] = find_or_flood_region(&regions, &ff, anchor.position);
+        }
+
+        destroy_flood_fill(&ff);
     }
 
-    // Spawn the jobs building the actual anchors
-    for(s64 i = 0; i < job_count; ++i) {
-        spawn_job(&this->job_system, { (Job_Procedure) volume_calculation_job, &jobs[i] });
+    s64 region_count = regions.regions.count;
+
+    //
+    // :AssemblySlices
+    // Set up the different jobs. Each region takes so long to calculate that it's probably worth it making
+    // every single one at least one job. The assembly time of a region grows with its cell count, so a region
+    // holding most of the world's cells would otherwise keep one thread busy while the others are idle.
+    // Therefore, every region gets a share of the workers proportional to its cell count, and its candidate
+    // triangles are split into that many slices.
+    //
+    s64 total_cell_count = 0;
+    for(Flood_Region &region : regions.regions) total_cell_count += region.cells.count;
+
+    s64 *region_first_job = (s64 *) this->allocator->allocate((region_count + 1) * sizeof(s64));
+
+    Resizable_Array<Volume_Calculation_Job> jobs;
+    jobs.allocator = this->allocator;
+
+    for(s64 i = 0; i < region_count; ++i) {
+        s64 slice_count = 1;
+
+#if USE_JOB_SYSTEM && !USE_MARCHING_CUBES_FOR_VOLUMES
+        if(total_cell_count > 0) slice_count = max((this->worker_count * regions.regions[i].cells.count + total_cell_count - 1) / total_cell_count, 1);
+#endif
+
+        region_first_job[i] = jobs.count;
+
+        for(s64 j = 0; j < slice_count; ++j) {
+            Volume_Calculation_Job *job = jobs.push();
+            job->world       = this;
+            job->region      = &regions.regions[i];
+            job->slice       = j;
+            job->slice_count = slice_count;
+        }
+    }
+
+    region_first_job[region_count] = jobs.count;
+
+#if USE_JOB_SYSTEM
+    // Spawn the jobs building the actual volumes
+    for(Volume_Calculation_Job &job : jobs) {
+        spawn_job(&this->job_system, { (Job_Procedure) volume_calculation_job, &job });
     }
                   
     // Wait for the jobs to complete
     wait_for_all_jobs(&this->job_system);
-    
-    // Destroy the job system.
-    destroy_job_system(&this->job_system, JOB_SYSTEM_Kill_Workers);
-    destroy_mutex(&this->mutex);
-
 #else
-    Volume_Calculation_Job job;
-    job.world = this;
-    job.first = 0;
-    job.last  = this->anchors.count - 1;
-    job.cell_world_space_size = cell_world_space_size;
-    volume_calculation_job(&job);
+    for(Volume_Calculation_Job &job : jobs) {
+        volume_calculation_job(&job);
+    }
 #endif
 
+    //
+    // :FloodRegions
+    // All anchors in a region share the same volume, which is made up of the slices of that region in order.
+    //
+    for(Anchor &anchor : this->anchors) {
+        s64 region = anchor_regions[anchor.id];
+
+        s64 triangle_count = 0;
+        for(s64 i = region_first_job[region]; i < region_first_job[region + 1]; ++i) triangle_count += jobs[i].volume.count;
+
+        anchor.volume.allocator = this->allocator;
+        anchor.volume.reserve(triangle_count);
+
+        for(s64 i = region_first_job[region]; i < region_first_job[region + 1]; ++i) {
+            for(Triangle &triangle : jobs[i].volume) anchor.volume.add(triangle);
+        }
+    }
+
+    for(Volume_Calculation_Job &job : jobs) job.volume.clear();
+    jobs.clear();
+
+    this->allocator->deallocate(region_first_job);
+    this->allocator->deallocate(anchor_regions);
+    destroy_flood_regions(&regions);
+
     release_temp_allocator(temp_mark);
 }
 
@@ -608,18 +934,53 @@ b8 World::point_inside_bounds(vec3 point) {
         point.z >= -this->half_size.z && point.z <= +this->half_size.z;
 }
 
-b8 World::cast_ray_against_delimiters_and_root_planes(vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {    
-#if USE_BVH_FOR_RAYCASTS    
-    auto result = this->bvh.cast_ray(ray_origin, ray_direction, max_ray_distance);
-    if(result.hit_something) return true;
+s64 World::get_root_face_tile(s64 face, vec3 point) {
+    Root_Face_Index *index = &this->root_face_indices[face];
+
+    real u = (point.values[index->u_axis] + this->half_size.values[index->u_axis]) / (2. * this->half_size.values[index->u_axis]);
+    real v = (point.values[index->v_axis] + this->half_size.values[index->v_axis]) / (2. * this->half_size.values[index->v_axis]);
+
+    s64 x = clamp((s64) (u * ROOT_FACE_GRID_SIZE), 0, ROOT_FACE_GRID_SIZE - 1);
+    s64 y = clamp((s64) (v * ROOT_FACE_GRID_SIZE), 0, ROOT_FACE_GRID_SIZE - 1);
+    return y * ROOT_FACE_GRID_SIZE + x;
+}
 
+b8 World::ray_exits_world_bounds(vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {
+    //
     // :RootPlanesBVH
-    for(auto &root_entry : this->root_bvh_entries) {
-        auto result = cast_ray_against_entry(&root_entry, ray_origin, ray_direction, max_ray_distance);
-        if(result.hit_something) return true;
+    // The tessellated root triangles always cover the entire surface of the world box, so a ray hits one of
+    // them exactly if it enters or leaves the box somewhere in [0, max_ray_distance].
+    //
+    real tnear = MIN_F32, tfar = MAX_F32;
+
+    for(s64 axis = 0; axis < AXIS_COUNT; ++axis) {
+        real origin    = ray_origin.values[axis];
+        real direction = ray_direction.values[axis];
+        real half_size = this->half_size.values[axis];
+
+        if(direction == 0.) {
+            // The ray is parallel to this slab, so it either stays inside of it or never touches the box.
+            if(origin < -half_size || origin > half_size) return false;
+            continue;
+        }
+
+        real t0 = (-half_size - origin) / direction;
+        real t1 = (+half_size - origin) / direction;
+        tnear = max(tnear, min(t0, t1));
+        tfar  = min(tfar,  max(t0, t1));
     }
-    
-    return false;
+
+    if(tnear > tfar) return false;
+
+    return (tnear >= 0. && tnear <= max_ray_distance) || (tfar >= 0. && tfar <= max_ray_distance);
+}
+
+b8 World::cast_ray_against_delimiters_and_root_planes(vec3 ray_origin, vec3 ray_direction, real max_ray_distance) {    
+#if USE_BVH_FOR_RAYCASTS    
+    // :RootPlanesBVH
+    if(this->ray_exits_world_bounds(ray_origin, ray_direction, max_ray_distance)) return true;
+
+    return this->bvh.occluded(ray_origin, ray_direction, max_ray_distance);
 #else
     b8 hit_something = false;
 
@@ -650,6 +1011,30 @@ b8 World::cast_ray_against_delimiters_and_root_planes(vec3 ray_origin, vec3 ray_
 #endif
 }
 
+u32 World::cast_rays_against_delimiters_and_root_planes(BVH_Ray_Packet *packet) {
+#if USE_BVH_FOR_RAYCASTS
+    u32 occluded_mask = 0;
+
+    // :RootPlanesBVH
+    for(s64 i = 0; i < packet->count; ++i) {
+        if(this->ray_exits_world_bounds(packet->origin[i], packet->direction[i], packet->max_distance[i])) occluded_mask |= (1 << i);
+    }
+
+    u32 all_rays_mask = (u32) ((1ull << packet->count) - 1);
+    if(occluded_mask == all_rays_mask) return occluded_mask;
+
+    return occluded_mask | this->bvh.cast_rays(packet);
+#else
+    u32 occluded_mask = 0;
+
+    for(s64 i = 0; i < packet->count; ++i) {
+        if(this->cast_ray_against_delimiters_and_root_planes(packet->origin[i], packet->direction[i], packet->max_distance[i])) occluded_mask |= (1 << i);
+    }
+
+    return occluded_mask;
+#endif
+}
+
 
 
 /* ---------------------------------------------- Random Utility ---------------------------------------------- */
@@ -11,6 +11,8 @@
 
 #include "typedefs.h"
 #include "bvh.h"
+#include "floodfill.h"
+#include "mapped_file.h"
 
 
 
@@ -45,6 +47,19 @@ struct Delimiter {
 
 /* -------------------------------------------------- World -------------------------------------------------- */
 
+#define ROOT_FACE_GRID_SIZE     16 // The number of tiles along each axis of a root face.
+#define ROOT_FACE_REGION_MARGIN 2  // In cells, how far outside of a flooded region's bounds the assembler still looks for root triangles.
+
+//
+// The tessellated triangles of one root clipping plane, bucketed by their center into a 2D grid of tiles
+// over that face. The triangles of tile i are root_bvh_entries[tile_offsets[i], tile_offsets[i + 1]). The
+// assembler uses this to only visit the tiles that a flooded region can reach.
+//
+struct Root_Face_Index {
+    s64 u_axis, v_axis; // The two axes spanning the face.
+    u32 tile_offsets[ROOT_FACE_GRID_SIZE * ROOT_FACE_GRID_SIZE + 1];
+};
+
 struct World {
     // --- World API
     void create(vec3 half_size);
@@ -60,6 +75,8 @@ struct World {
     Delimiter *add_delimiter(string dbg_name, vec3 position, vec3 size, quat rotation, u8 level);
     void add_delimiter_plane(Delimiter *delimiter, Axis_Index normal_axis, b8 centered = false, Virtual_Extension virtual_extension = VIRTUAL_EXTENSION_All);
     void add_both_delimiter_planes(Delimiter *delimiter, Axis_Index normal_axis, Virtual_Extension virtual_extension = VIRTUAL_EXTENSION_All);
+    void move_delimiter(Delimiter *delimiter, vec3 position, quat rotation);
+    void set_bvh_cache(string file_path);
     void calculate_volumes(real cell_world_space_size = 10.);
     Anchor *query(vec3 point);
     
@@ -79,9 +96,11 @@ struct World {
 #if USE_JOB_SYSTEM
     Mutex mutex;
     Job_System job_system;
+    s64 worker_count; // The number of threads the job system was created with.
 #endif
     
     vec3 half_size; // This size is used to initialize the bvh. The bvh implementation does not support dynamic size changing, so this should be fixed.
+    real cell_world_space_size; // The cell size of the last calculate_volumes, zero before that.
 
     // The world owns all objects that are part of this problem. These objects
     // are stored here and can then be referenced in other parts of the algorithm.
@@ -105,18 +124,43 @@ struct World {
     // :RootPlanesBVH
     // The root triangles are fucking terrible for the BVH as they tend to be really large and covering the entire
     // world space, which would lead to the BVH nodes to not have any shrinkage (and therefore benefit) at all.
-    // Instead, we must manually cast against them.
-    Resizable_Array<BVH_Entry> root_bvh_entries; 
+    // Since they always cover the six faces of the world box, rays are tested against the box analytically
+    // instead (see ray_exits_world_bounds). The triangles themselves are only needed by the assembler, which
+    // adds them to the volumes.
+    Resizable_Array<BVH_Entry> root_bvh_entries; // Sorted by face (in the order of root_clipping_planes), then by tile.
+    Root_Face_Index root_face_indices[6];
+
+    // :CellEdgeMask
+    // The cell grid shared by the flood fills of all anchors, built once per calculate_volumes.
+    Cell_Grid cell_grid;
+
+    // :BVHCache
+    // If a cache file is set, create_bvh first tries to map the finished BVH from that file, which is only
+    // used if it was built from exactly the same delimiter triangles. Otherwise, the BVH is built as usual and
+    // then written to the file for the next run. The owners of the BVH entries are the delimiter planes,
+    // which are identified by (delimiter index * 6 + plane index) in the file.
+    string bvh_cache_file_path;
+    Mapped_File bvh_cache_file;
+    void **bvh_cache_owners;
     
 
     // --- Internal implementation
     void create_bvh();
     void create_bvh_from_triangles(Resizable_Array<Triangle> &triangles);
+    b8 map_bvh_cache();
+    void write_bvh_cache();
+    void free_bvh_cache_owners();
+    void build_root_face_indices();
+    void update_delimiter_plane_in_bvh(Triangulated_Plane *plane);
     void clip_delimiters();
-    void build_anchor_volumes(real cell_world_space_size);
+    void build_cell_grid(real cell_world_space_size);
+    void build_anchor_volumes();
 
     b8 point_inside_bounds(vec3 point);
+    s64 get_root_face_tile(s64 face, vec3 point);
+    b8 ray_exits_world_bounds(vec3 ray_origin, vec3 ray_direction, real max_ray_distance);
     b8 cast_ray_against_delimiters_and_root_planes(vec3 ray_origin, vec3 ray_direction, real max_ray_distance);
+    u32 cast_rays_against_delimiters_and_root_planes(BVH_Ray_Packet *packet);
 };
 
 
@@ -190,6 +190,10 @@ public class Core_Bindings {
     [DllImport("Core.dll")]
     public static extern void core_add_delimiter_plane(World_Handle world, s64 delimiter_index, Axis_Index axis_index, bool centered, Virtual_Extension extension);
     [DllImport("Core.dll")]
+    public static extern void core_move_delimiter(World_Handle world, s64 delimiter_index, f64 x, f64 y, f64 z, f64 rx, f64 ry, f64 rz, f64 rw);
+    [DllImport("Core.dll")]
+    public static extern void core_set_bvh_cache(World_Handle world, [MarshalAs(UnmanagedType.LPStr)] string file_path);
+    [DllImport("Core.dll")]
     public static extern void core_calculate_volumes(World_Handle world, f64 cell_world_space_size);
     [DllImport("Core.dll")]
     public static extern s64 core_query_point(World_Handle world, f64 x, f64 y, f64 z);
@@ -378,6 +382,8 @@ public unsafe class Core_Helpers {
             }
         }
 
+        // Skips building the BVH if the delimiters haven't changed since the last time.
+        Core_Bindings.core_set_bvh_cache(world_handle, Application.temporaryCachePath + "/delimiters.bvh");
         Core_Bindings.core_calculate_volumes(world_handle, cell_world_space_size);
 
         return world_handle;
@@ -412,7 +418,7 @@ public unsafe class Core_Helpers {
 
     public static void serialize_world_setup_code(string file_path, double cell_world_space_size) {
         StringBuilder builder = new StringBuilder();
-        builder.Append("void setup_world() {\n");
+        builder.Append("World_Handle setup_world() {\n");
 
         Vector3 size = calculate_world_size();
         builder.AppendFormat("    World_Handle world = core_create_world({0}, {1}, {2});\n", size.x, size.y, size.z);
@@ -442,6 +448,7 @@ public unsafe class Core_Helpers {
         }
         
         builder.AppendFormat("    core_calculate_volumes(world, {0});\n", cell_world_space_size);
+        builder.Append("    return world;\n");
         builder.Append("}\n");
 
         File.WriteAllText(file_path, builder.ToString());